@@ -37,6 +37,8 @@ struct bpkg_query bpkg_get_all_hashes(struct bpkg_obj* bpkg);
 
 struct bpkg_query bpkg_get_completed_chunks(struct bpkg_obj* bpkg);
 
+int bpkg_get_chunk_status(struct bpkg_obj* bpkg, uint8_t* status);
+
 struct bpkg_query bpkg_get_min_completed_hashes(struct bpkg_obj* bpkg); 
 
 struct bpkg_query bpkg_get_all_chunk_hashes_from_hash(struct bpkg_obj* bpkg, char* hash);
@@ -3,10 +3,37 @@
 
 #include <stdint.h>
 
+#define DEFAULT_REQUEST_WINDOW 64
+#define DEFAULT_MAX_PEERS 64
+#define DEFAULT_PEER_QUEUE_KIB 4096
+#define MAX_RATE_KIBPS 4194304
+#define DEFAULT_UPLOAD_SLOTS 4
+#define DEFAULT_CACHE_KIB 32768
+#define DEFAULT_READAHEAD_KIB 8192
+#define DEFAULT_CONNECT_TIMEOUT_MS 5000
+#define LOCAL_SOCKET_MAX 108   // sizeof sun_path
+
+#define IO_ENGINE_EPOLL 0
+#define IO_ENGINE_URING 1
+
 typedef struct {
     char directory[256];  // Path to the directory for storing files
     int max_peers;        // Maximum number of peers
     uint16_t port;        // Listening port
+    int request_window;   // Most REQs outstanding to one peer
+    int peer_queue_kib;   // Output queued for one peer before we stop reading from it
+    int io_engine;        // IO_ENGINE_URING batches reads and sends into fewer syscalls, epoll when unavailable
+    int upload_kibps;     // Rate limits in KiB/s, 0 for unlimited
+    int download_kibps;
+    int peer_upload_kibps;
+    int peer_download_kibps;
+    int upload_slots;     // Peers served at once on merit, one more is unchoked on trial
+    int cache_kib;        // Memory for chunks kept for serving, 0 to read every request from disk
+    int readahead_kib;    // How far past the readable prefix a streaming download fetches in order
+    int connect_timeout_ms; // Outgoing connects not answered by then fail
+    char local_socket[LOCAL_SOCKET_MAX]; // Unix domain socket path also listened on, empty for none
+    int udp_transport;    // Also take peers over UDP on the same port number
+    int udp_loss_percent; // Share of arriving datagrams dropped on purpose, for testing
 } Config;
 
 int load_config(const char* filepath, Config* cfg);
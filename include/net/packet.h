@@ -2,17 +2,50 @@
 #define NETPKT_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 #define PAYLOAD_MAX (4092)
+#define PACKET_SIZE (4096)
 
 #define PKT_MSG_ACK 0x0c
 #define PKT_MSG_ACP 0x02
 #define PKT_MSG_DSN 0x03
 #define PKT_MSG_REQ 0x06
 #define PKT_MSG_RES 0x07
+#define PKT_MSG_HEL 0x10
+#define PKT_MSG_BFD 0x11
+#define PKT_MSG_HAV 0x12
+#define PKT_MSG_BRQ 0x13
+#define PKT_MSG_CHK 0x14
+#define PKT_MSG_UNC 0x15
+#define PKT_MSG_CAN 0x16
+#define PKT_MSG_RFD 0x17
 #define PKT_MSG_PNG 0xFF
 #define PKT_MSG_POG 0x00
 
+// DSN error codes
+#define PKT_DSN_FULL 1         // Sent instead of accepting when at max_peers
+
+// Framing, legacy peers only understand fixed 4096-byte frames
+#define PKT_FRAME_FIXED 0
+#define PKT_FRAME_V1 1
+
+// Feature bits carried in the second byte of HEL
+#define PKT_FEAT_HAVE 0x01
+#define PKT_FEAT_BATCH 0x02
+#define PKT_FEAT_PING 0x04
+#define PKT_FEAT_CHOKE 0x08
+#define PKT_FEAT_CANCEL 0x10
+#define PKT_FEAT_FDPASS 0x20   // Only offered over Unix domain sockets
+
+// Length-prefixed frame header: magic, version, code, error, reserved, length
+#define PKT_V1_MAGIC 0xB7
+#define PKT_V1_HDR (12)
+#define PKT_BODY_MAX (16 * 1024 * 1024)
+
+#define PKT_READER_INIT (64 * 1024)
+#define PKT_READER_FDS_MAX (64)     // Passed descriptors held before their frames are handled
 
 union btide_payload {
     uint8_t data[PAYLOAD_MAX];
@@ -22,10 +55,68 @@ union btide_payload {
 struct btide_packet {
     uint16_t msg_code;
     uint16_t error;
+    uint32_t len;       // Payload length, always PAYLOAD_MAX for fixed frames
+    uint8_t *body;      // Payload beyond PAYLOAD_MAX, used instead of pl when set
+    int body_owned;     // Set when body was allocated by the receive path
     union btide_payload pl;
 };
 
+// Per-connection input buffer, bytes of a partial frame are kept across fills
+struct pkt_reader {
+    uint8_t *buf;
+    size_t start;       // First byte not yet returned as a frame
+    size_t end;         // End of the buffered bytes
+    size_t cap;
+    int pass_fds;       // Set on Unix domain sockets, descriptors passed with the bytes are kept
+    int fds[PKT_READER_FDS_MAX];    // Received descriptors in stream order, not yet taken
+    int nfds;
+};
+
+// File bytes spliced into the output stream after buffer position at
+struct pkt_file_segment {
+    size_t at;
+    int fd;
+    off_t offset;
+    size_t len;
+    int pass;           // fd itself goes with the byte at at instead, over a Unix domain socket
+    struct pkt_file_segment *next;
+};
+
+// Per-connection output buffer for non-blocking sockets
+struct pkt_writer {
+    uint8_t *buf;
+    size_t start;       // First byte not yet written to the socket
+    size_t end;
+    size_t cap;
+    size_t file_bytes;  // File bytes still queued behind the buffer
+    struct pkt_file_segment *files;
+    struct pkt_file_segment *files_tail;
+};
+
+void packet_init(struct btide_packet *packet, uint16_t msg_code);
+uint8_t *packet_payload(struct btide_packet *packet);
+void packet_release(struct btide_packet *packet);
 int send_packet(int socket, struct btide_packet *packet);
+int send_packet_framed(int socket, struct btide_packet *packet, int framing);
 int receive_packet(int socket, struct btide_packet *packet);
+int pkt_reader_init(struct pkt_reader *reader);
+void pkt_reader_destroy(struct pkt_reader *reader);
+int pkt_reader_fill(struct pkt_reader *reader, int socket);
+int pkt_reader_next(struct pkt_reader *reader, struct btide_packet *packet);
+int pkt_reader_take_fd(struct pkt_reader *reader);
+size_t pkt_frame_peek(const uint8_t *head, size_t avail, uint16_t *msg_code, size_t *hdr_len);
+int pkt_writer_init(struct pkt_writer *writer);
+void pkt_writer_destroy(struct pkt_writer *writer);
+int pkt_writer_queue(struct pkt_writer *writer, struct btide_packet *packet, int framing);
+int pkt_writer_queue_parts(struct pkt_writer *writer, struct btide_packet *packet, size_t inline_len,
+                           const uint8_t *data, int framing);
+int pkt_writer_queue_file(struct pkt_writer *writer, struct btide_packet *packet, size_t inline_len,
+                          int fd, off_t offset);
+int pkt_writer_queue_fd(struct pkt_writer *writer, struct btide_packet *packet, int framing, int fd);
+int pkt_writer_flush(struct pkt_writer *writer, int socket);
+int pkt_writer_flush_some(struct pkt_writer *writer, int socket, size_t budget, size_t *sent);
+size_t pkt_writer_pending(struct pkt_writer *writer);
+size_t pkt_writer_inline(struct pkt_writer *writer, uint8_t **data);
+void pkt_writer_consume(struct pkt_writer *writer, size_t len);
 
 #endif
@@ -0,0 +1,66 @@
+#ifndef PROTO_H
+#define PROTO_H
+
+#include "packet.h"
+
+#define PROTO_HASH_LEN (64)
+#define PROTO_IDENT_MAX (1024)
+#define RES_HDR_FIXED (4 + 4 + PROTO_HASH_LEN + 2)
+#define RES_HDR_MAX (RES_HDR_FIXED + PROTO_IDENT_MAX)
+#define BRQ_RANGE_SIZE (12)
+#define BRQ_RANGES_MAX ((PAYLOAD_MAX - 4 - PROTO_IDENT_MAX) / BRQ_RANGE_SIZE)
+
+struct btide_req {
+    uint32_t offset;                        // Offset within the chunk
+    char identifier[PROTO_IDENT_MAX + 1];
+    char chunk_hash[PROTO_HASH_LEN + 1];
+    int32_t chunk_index;                    // Index within the package, -1 if unknown
+};
+
+// One entry of a batched request
+struct btide_range {
+    uint32_t index;
+    uint32_t offset;
+    uint32_t len;                           // 0 for the rest of the chunk
+};
+
+struct btide_batch {
+    char identifier[PROTO_IDENT_MAX + 1];
+    int count;
+    struct btide_range ranges[BRQ_RANGES_MAX];
+};
+
+struct btide_res {
+    uint32_t offset;                        // Offset within the chunk
+    uint32_t data_len;
+    char chunk_hash[PROTO_HASH_LEN + 1];
+    char identifier[PROTO_IDENT_MAX + 1];
+    uint8_t *data;                          // Points into the packet payload, or read from an RFD's descriptor
+};
+
+// Completion bitmap of one package, bit i%8 of byte i/8 is chunk i
+struct btide_bitfield {
+    char identifier[PROTO_IDENT_MAX + 1];
+    uint32_t nchunks;
+    const uint8_t *bits;                    // Points into the packet payload
+};
+
+struct btide_have {
+    char identifier[PROTO_IDENT_MAX + 1];
+    uint32_t index;
+};
+
+int req_encode(struct btide_packet *packet, const struct btide_req *req);
+int req_decode(struct btide_packet *packet, struct btide_req *req);
+size_t res_header_encode(const struct btide_res *res, uint8_t *out);
+int res_decode(struct btide_packet *packet, struct btide_res *res);
+size_t rfd_encode(const struct btide_res *res, uint64_t file_offset, uint8_t *out);
+int rfd_decode(struct btide_packet *packet, struct btide_res *res, uint64_t *file_offset);
+size_t bitfield_encode(const char *identifier, uint32_t nchunks, const uint8_t *bits, uint8_t *out);
+int bitfield_decode(struct btide_packet *packet, struct btide_bitfield *bitfield);
+size_t batch_encode(const struct btide_batch *batch, uint8_t *out);
+int batch_decode(struct btide_packet *packet, struct btide_batch *batch);
+size_t have_encode(const struct btide_have *have, uint8_t *out);
+int have_decode(struct btide_packet *packet, struct btide_have *have);
+
+#endif
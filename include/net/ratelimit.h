@@ -0,0 +1,24 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RATE_BURST_MS (100)         // A full bucket holds this long at the configured rate
+#define RATE_BURST_MIN (16384)
+
+// Bytes per millisecond, refilled lazily from the reactor clock
+struct token_bucket {
+    double rate;        // 0 when unlimited
+    double burst;
+    double tokens;      // Goes negative when a read overshoots, later refills repay it
+    uint64_t last_ms;
+};
+
+void bucket_init(struct token_bucket *bucket, int kibps, uint64_t now);
+int bucket_limited(const struct token_bucket *bucket);
+size_t bucket_available(struct token_bucket *bucket, uint64_t now);
+void bucket_take(struct token_bucket *bucket, size_t len);
+void bucket_return(struct token_bucket *bucket, size_t len);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define REACTOR_MAX_EVENTS (256)
+
+typedef void (*reactor_fn)(void *ctx, uint32_t events);
+
+struct reactor_handler {
+    int fd;
+    int timer;          // Set for timerfds, expirations are read before fn runs
+    reactor_fn fn;
+    void *ctx;
+};
+
+int reactor_init();
+int reactor_add(struct reactor_handler *handler, uint32_t events);
+int reactor_mod(struct reactor_handler *handler, uint32_t events);
+void reactor_del(struct reactor_handler *handler);
+int reactor_add_timer(struct reactor_handler *handler, int interval_ms);
+void reactor_defer_free(void *ptr, void (*release)(void *));
+void reactor_set_flush(void (*flush)());
+void reactor_run();
+void reactor_stop();
+uint64_t reactor_now_ms();
+
+#endif
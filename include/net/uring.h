@@ -0,0 +1,23 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define URING_ENTRIES (256)
+#define URING_NBUFS (32)           // Registered buffers, one packet each
+#define URING_BUF_SIZE (4096)
+
+typedef void (*uring_complete_fn)(void *ctx, uint64_t tag, int res);
+
+int uring_init(unsigned entries);
+int uring_enabled();
+void uring_shutdown();
+uint8_t *uring_buffer(int index);
+int uring_queue_read_fixed(int fd, int buf_index, size_t buf_offset, size_t len, off_t offset, uint64_t tag);
+int uring_queue_send(int socket, const void *buf, size_t len, int flags, uint64_t tag);
+int uring_queued();
+int uring_submit_wait(uring_complete_fn fn, void *ctx);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef CHOKE_H
+#define CHOKE_H
+
+#include <stdint.h>
+#include "peer.h"
+
+#define CHOKE_INTERVAL_MS (10000)
+#define CHOKE_OPTIMISTIC_ROUNDS (3)    // Rechokes between moves of the optimistic slot
+#define CHOKE_NEWCOMER_MS (60000)      // Peers connected this recently are likelier optimistic picks
+
+void choke_tick(uint64_t now, int seeding);
+void choke_on_message(struct peer *peer, struct btide_packet *packet);
+const char *choke_state(struct peer *peer);
+
+#endif
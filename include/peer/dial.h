@@ -0,0 +1,18 @@
+#ifndef DIAL_H
+#define DIAL_H
+
+#include <stdint.h>
+#include "peer.h"
+
+#define DIAL_BACKOFF_MIN_MS (1000)   // Wait before the first reconnect, doubled for each one after
+#define DIAL_BACKOFF_MAX_MS (60000)
+#define DIAL_MAX_RETRIES (8)         // Reconnects tried before a dropped peer is given up on
+#define DIAL_STABLE_MS (60000)       // A connection up this long starts the backoff over
+
+int dial_peer(const char *ip, int port);
+void dial_retry(const char *ip, int port, int retries);
+int dial_cancel(const char *ip, int port);
+int dial_pending();
+void dial_tick(uint64_t now);
+
+#endif
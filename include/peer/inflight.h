@@ -0,0 +1,69 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <stdint.h>
+#include "../net/proto.h"
+
+#define INFLIGHT_WINDOW_INIT (4)
+#define INFLIGHT_RTO_INIT_MS (2000)
+#define INFLIGHT_RTO_MIN_MS (200)
+#define INFLIGHT_RTO_MAX_MS (10000)
+#define INFLIGHT_MAX_RETRIES (3)
+
+// How a tracked request ended
+#define INFLIGHT_DONE 0
+#define INFLIGHT_FAILED 1      // Peer answered with an error
+#define INFLIGHT_TIMEOUT 2     // No answer after every retransmit
+#define INFLIGHT_CHOKED 3      // Peer choked us, the request was never served
+
+struct peer;
+
+struct inflight_req {
+    struct btide_req req;
+    uint32_t expected;      // Bytes the request covers, from req.offset
+    uint32_t received;      // Contiguous bytes received so far
+    uint64_t sent_ms;       // When sent, or when its latest in-order piece arrived
+    int retries;
+};
+
+struct inflight_table {
+    struct inflight_req *slots;     // Outstanding requests, count used
+    int count;
+    int max_window;                 // Configured ceiling for the window
+    double window;                  // Requests allowed in flight
+    double ssthresh;                // Growth turns additive above this
+    struct btide_req *queue;        // Requests waiting for window space
+    uint32_t *queue_expected;
+    int qhead;
+    int qlen;
+    int qcap;
+    double srtt_ms;                 // Smoothed RTT, 0 until sampled
+    double rttvar_ms;
+    double path_rtt_ms;             // PING round trip, excludes time spent serving
+    double path_jitter_ms;
+    double rate;                    // Smoothed delivery rate in bytes per ms
+    uint64_t rate_bytes;            // Bytes delivered since the last rate sample
+    uint64_t rate_start_ms;
+    double avg_req_bytes;
+};
+
+typedef void (*inflight_done_fn)(struct peer *peer, struct btide_req *req, int status);
+
+int inflight_init(struct inflight_table *table, int max_window);
+void inflight_destroy(struct inflight_table *table);
+void inflight_set_done_handler(inflight_done_fn fn);
+int inflight_submit(struct peer *peer, const struct btide_req *req, uint32_t expected);
+int inflight_expects(struct peer *peer, struct btide_res *res);
+int inflight_on_response(struct peer *peer, struct btide_res *res, uint16_t error);
+void inflight_check_timeouts(struct peer *peer, uint64_t now);
+int inflight_window(struct inflight_table *table);
+void inflight_abort(struct peer *peer);
+void inflight_release(struct peer *peer);
+int inflight_cancel_queued(struct peer *peer, const char *identifier, const char *hash, uint32_t offset, uint32_t len);
+int inflight_cancel(struct peer *peer, const char *identifier, const char *hash, uint32_t offset, uint32_t len);
+int inflight_has(struct peer *peer, const char *identifier, const char *hash, uint32_t offset, uint32_t len);
+int inflight_load(struct inflight_table *table);
+void inflight_set_path_rtt(struct inflight_table *table, double rtt_ms, double jitter_ms);
+void inflight_postpone(struct inflight_table *table, uint64_t ms);
+
+#endif
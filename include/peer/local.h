@@ -0,0 +1,11 @@
+#ifndef LOCAL_H
+#define LOCAL_H
+
+#include "peer.h"
+
+#define LOCAL_PEER_IP "unix"   // Address local peers are listed under, the port numbers them
+
+int local_listen(const char *path);
+int local_connect(const char *path);
+
+#endif
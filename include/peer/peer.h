@@ -3,24 +3,125 @@
 
 #include <arpa/inet.h>
 #include "../net/packet.h"
+#include "../net/reactor.h"
+#include "../net/ratelimit.h"
+#include "inflight.h"
+#include "../pkg/bitmap.h"
 
 #define INET_ADDRSTRLEN 16
+#define PEER_PING_INTERVAL_MS (1000)
+#define PEER_DEAD_MS (5000)        // Silence after which a pinged peer is dropped
+#define PEER_REJECTED (-2)         // accept_connection turned a connection away
+#define PEER_FAILED (-3)           // accept_connection lost one connection, more may be waiting
+#define PEER_PACE_MS (10)          // How often rate limited transfers are resumed
+#define PEER_QUANTUM (16384)       // Bytes added to a peer's deficit each scheduling round
+
+// What a peer is known to hold of one package
+struct peer_avail {
+    char identifier[PROTO_IDENT_MAX + 1];
+    int known;                  // Set once the peer has advertised its chunks
+    struct chunk_bitmap have;   // Advertised chunks, meaningful when known
+    struct chunk_bitmap failed; // Chunks the peer could not or did not serve
+    struct peer_avail *next;
+};
+
+// A range a peer asked for, turned into RES frames as its output queue drains
+struct serve_job {
+    char identifier[PROTO_IDENT_MAX + 1];
+    int index;
+    uint32_t offset;
+    uint32_t end;
+    struct serve_job *next;
+};
 
 struct peer {
     char ip[INET_ADDRSTRLEN];
     int port;
     int socket;
+    int framing;        // Framing used when sending, upgraded by the peer's HEL
+    int local;          // Connected over a Unix domain socket, see local.c
+    int tcp;            // TCP socket, Nagle is off and it is corked around file data
+    int features;       // PKT_FEAT_* bits from the peer's HEL
+    int closed;         // Set once removed, the struct is freed after the current events
+    int throttled;      // Reading paused until the output queue drains
+    int flush_queued;   // On the list of peers sent to at the end of the loop iteration
+    int send_res;       // Result of the batched send
+    size_t send_len;    // Bytes handed to the batched send
+    int read_paused;    // Reading paused until the download buckets refill
+    uint64_t paused_ms; // When reading was paused
+    size_t deficit;     // Bytes the peer may still send in this round of the scheduler
+    struct token_bucket up;
+    struct token_bucket down;
+    struct pkt_reader rx;   // Bytes received but not yet handled
+    struct pkt_writer tx;   // Bytes the socket has not accepted yet
+    struct reactor_handler handler;
+    struct inflight_table inflight; // REQs sent to this peer and not yet answered
+    struct peer_avail *avail;       // Per package chunk availability
+    uint64_t last_heard_ms;         // Last time any bytes arrived from the peer
+    uint64_t ping_sent_ms;          // When the last PING was queued, it carries this as its stamp
+    uint64_t ping_wire_ms;          // When the last PING reached the socket, 0 while still queued
+    size_t ping_ahead;              // Queued bytes up to the end of the last PING not yet written
+    double rtt_ms;                  // Smoothed PING round trip, 0 until sampled
+    double jitter_ms;               // Smoothed change between consecutive samples
+    double last_rtt_ms;
+    uint64_t connected_ms;
+    int redial;                     // We dialed it, a drop schedules a reconnect
+    int retries;                    // Reconnects made since the connection last stayed up
+    uint64_t rx_bytes;              // Everything read from and queued to the peer
+    uint64_t tx_bytes;
+    uint64_t rx_mark;               // Totals at the last rechoke
+    uint64_t tx_mark;
+    double down_rate;               // Smoothed bytes per second from and to the peer
+    double up_rate;
+    int req_ok;                     // Our requests the peer served, and those it did not
+    int req_failed;
+    double score;                   // Worth of the peer to us, see choke.c
+    int choked;                     // We do not serve its requests
+    int optimistic;                 // Unchoked on trial rather than on score
+    int choking_us;                 // It does not serve ours
+    struct serve_job *jobs;         // Requests from the peer not yet queued as output
+    struct serve_job *jobs_tail;
+    size_t job_bytes;
     struct peer *next;
+    struct peer *prev;
+    struct peer *addr_next;         // Chain in the (ip, port) index
+    struct peer *fd_next;           // Chain in the socket index
+    struct peer *flush_next;
 };
 
+typedef void (*peer_packet_fn)(struct peer *peer, struct btide_packet *packet);
+typedef void (*peer_drain_fn)(struct peer *peer);
+typedef void (*peer_remove_fn)(struct peer *peer);
+
 // Function declarations
 void add_peer(struct peer *new_peer);
 void remove_peer(struct peer *peer_to_remove);
 struct peer *find_peer(const char *ip, int port);
+struct peer *find_peer_by_fd(int fd);
 struct peer *get_peer_list();
-int connect_to_peer(const char *ip, int port);
+int peer_count();
+struct peer *peer_register(int sockfd, const char *ip, int port);
+void peer_reject(int sockfd);
 int accept_connection(int listening_socket);
 void disconnect_peer(struct peer *peer);
-void check_for_disconnection(int peer_socket);
+void peer_set_packet_handler(peer_packet_fn fn);
+void peer_set_drain_handler(peer_drain_fn fn);
+void peer_set_remove_handler(peer_remove_fn fn);
+void peer_drop_jobs(struct peer *peer);
+int peer_send(struct peer *peer, struct btide_packet *packet);
+int peer_send_parts(struct peer *peer, struct btide_packet *packet, size_t inline_len, const uint8_t *data);
+int peer_send_file(struct peer *peer, struct btide_packet *packet, size_t inline_len, int fd, off_t offset);
+int peer_send_fd(struct peer *peer, struct btide_packet *packet, int fd);
+int peer_take_fd(struct peer *peer);
+int peer_send_hello(struct peer *peer);
+void peer_handle_hello(struct peer *peer, struct btide_packet *packet);
+int peer_keepalive(struct peer *peer, uint64_t now);
+void peer_flush_queued();
+int peer_rate_init();
+struct peer_avail *peer_get_avail(struct peer *peer, const char *identifier, uint32_t nchunks);
+int peer_may_have(struct peer *peer, const char *identifier, uint32_t index);
+void peer_mark_failed(struct peer *peer, const char *identifier, uint32_t nchunks, uint32_t index);
+void peer_set_bitfield(struct peer *peer, const char *identifier, uint32_t nchunks, const uint8_t *bits);
+void peer_set_have(struct peer *peer, const char *identifier, uint32_t nchunks, uint32_t index);
 
 #endif 
@@ -0,0 +1,37 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <stdint.h>
+#include "peer.h"
+
+// Datagram header: magic, version, type, flags, connection id (4), packet number (4)
+#define UDP_MAGIC 0xB8
+#define UDP_VERSION 1
+#define UDP_HDR (12)
+#define UDP_DATA_HDR (UDP_HDR + 10)     // DATA adds stream id (2) and stream offset (8)
+#define UDP_DATAGRAM_MAX (1200)         // Kept under common path MTUs so datagrams never fragment
+#define UDP_SEG_MAX (UDP_DATAGRAM_MAX - UDP_DATA_HDR)
+
+#define UDP_DATA 1
+#define UDP_ACK 2
+#define UDP_CLOSE 3
+
+#define UDP_STREAMS (4097)              // Stream 0 carries control messages, each RES takes one of the rest while unacknowledged
+#define UDP_ACK_RANGES (32)             // Ranges of received packet numbers reported in one ACK
+#define UDP_REORDER (3)                 // Later packets acknowledged before one in a gap between ranges counts as lost
+#define UDP_TICK_MS (10)
+#define UDP_RTO_INIT_MS (300)
+#define UDP_RTO_MIN_MS (50)
+#define UDP_RTO_MAX_MS (4000)
+#define UDP_DEAD_MS (10000)             // Data unacknowledged this long closes the connection
+#define UDP_INIT_CWND (10 * UDP_SEG_MAX)
+#define UDP_MIN_CWND (2 * UDP_SEG_MAX)
+#define UDP_READ_AHEAD (256 * 1024)     // Bytes taken from the peer before they can be sent
+#define UDP_SEND_MAX (8 * 1024 * 1024)  // Bytes in flight and waiting to be resent
+#define UDP_RECV_MAX (8 * 1024 * 1024)  // Bytes received but not yet handed to the peer
+#define UDP_SOCKET_BUF (4 * 1024 * 1024)
+
+int udp_listen(uint16_t port);
+int udp_connect(const char *ip, int port);
+
+#endif
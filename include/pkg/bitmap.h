@@ -0,0 +1,25 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define BITMAP_WORD_BITS (64)
+
+struct chunk_bitmap {
+    uint32_t nbits;             // Number of chunks tracked
+    _Atomic uint64_t *words;    // One bit per chunk, set once verified
+};
+
+int bitmap_init(struct chunk_bitmap *bm, uint32_t nbits);
+void bitmap_destroy(struct chunk_bitmap *bm);
+int bitmap_set(struct chunk_bitmap *bm, uint32_t index);
+int bitmap_clear(struct chunk_bitmap *bm, uint32_t index);
+int bitmap_test(const struct chunk_bitmap *bm, uint32_t index);
+uint32_t bitmap_count(const struct chunk_bitmap *bm);
+size_t bitmap_bytes(uint32_t nbits);
+void bitmap_export(const struct chunk_bitmap *bm, uint8_t *out);
+void bitmap_import(struct chunk_bitmap *bm, const uint8_t *in);
+
+#endif
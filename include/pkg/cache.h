@@ -0,0 +1,23 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CACHE_SHARDS (16)
+#define CACHE_BUCKETS (256)        // Hash buckets per shard
+
+struct cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    size_t bytes;               // Chunk bytes held
+    size_t capacity;
+    int entries;
+};
+
+int cache_init(size_t bytes);
+int cache_get(const char *hash, int fd, off_t offset, uint32_t len, const uint8_t **data);
+void cache_get_stats(struct cache_stats *stats);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef DOWNLOAD_H
+#define DOWNLOAD_H
+
+#include "package.h"
+#include "../peer/peer.h"
+
+#define DOWNLOAD_STALL_MS (5000)
+#define DOWNLOAD_ENDGAME_BLOCKS (8)  // Missing blocks at which requests are duplicated
+#define DOWNLOAD_ENDGAME_PEERS (3)   // Peers asked for each block in end game
+#define DOWNLOAD_BLOCK_SIZE (65536)  // Larger chunks are fetched in blocks from several peers
+
+// Part of a chunk requested as one unit, a chunk up to DOWNLOAD_BLOCK_SIZE is a single block
+struct download_block {
+    uint32_t offset;            // Offset within the chunk
+    uint32_t len;
+    struct peer *assigned;      // Peer the block is requested from, NULL if none
+    uint64_t assigned_ms;       // When the block was handed to that peer
+    struct peer *source;        // Peer that delivered the block, while done and it is connected
+    int done;                   // Received, the chunk is verified once all its blocks are
+};
+
+struct download {
+    struct package *pkg;
+    struct download_block *blocks;  // Blocks of every chunk in file order
+    int *first_block;           // Each chunk's first block, nchunks + 1 entries
+    int *order;                 // Missing chunks, rarest first
+    int norder;
+    int endgame;                // Set once few enough chunks are missing to ask several peers
+    int streaming;              // Chunks within the read-ahead window go first, in file order
+    struct download *next;
+};
+
+int download_start(const char *identifier, int streaming);
+void download_cancel(const char *identifier);
+void download_schedule_all();
+int download_active();
+void download_on_request_done(struct peer *peer, struct btide_req *req, int status);
+void download_on_corrupt(struct peer *peer, const char *identifier, int index);
+void download_on_peer_removed(struct peer *peer);
+struct download *find_download(const char *identifier);
+
+#endif
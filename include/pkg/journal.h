@@ -0,0 +1,15 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "package.h"
+
+#define JOURNAL_FILE ".btide.journal"
+#define JOURNAL_COMPACT_RECORDS (4096)
+
+int journal_open(const char *directory);
+void journal_package_added(struct package *pkg);
+void journal_package_removed(const char *identifier);
+void journal_chunk_verified(struct package *pkg, int index);
+int journal_compact();
+
+#endif
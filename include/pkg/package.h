@@ -4,14 +4,38 @@
 #include "../net/packet.h"
 #include "../chk/pkgchk.h"
 #include "../config/config.h"
+#include "bitmap.h"
+#include "../crypt/sha256.h"
+#include <time.h>
+
+// What package_store did with the bytes it was given
+#define PACKAGE_STORE_PARTIAL 0     // Stored, the chunk is not complete yet
+#define PACKAGE_STORE_COMMITTED 1   // The last byte arrived, verified and written
+#define PACKAGE_STORE_CORRUPT (-2)  // The chunk was complete but failed its hash
+
+// Digest of a chunk being received, fed in order as its bytes arrive
+struct chunk_rx {
+    struct sha256_compute_data sha;
+    uint32_t hashed;    // Bytes from the start of the chunk fed so far
+    int broken;         // Bytes arrived out of order, verify from memory at the end
+};
 
 struct package {
     char identifier[1024];
     char filename[256];
+    char pkgfile[256];   // .bpkg file name relative to the config directory
+    char datapath[520];  // Data file path
     int size;
     int nchunks;
-    int completed_chunks;
+    atomic_int completed_chunks;
+    struct chunk_bitmap have; // Verified chunks, indexed like chunks
+    int prefix_chunks;        // Leading chunks, in file order, that are all verified
+    long long data_size;         // Data file size when the bitmap was last journaled
+    struct timespec data_mtime;  // Data file mtime when the bitmap was last journaled
     struct chunk *chunks;
+    struct chunk_rx **rx;   // Per chunk, set while the chunk is being received
+    int data_fd;         // Data file, opened on first use
+    int read_fd;         // Data file opened read-only, passed to local peers
     struct package *next;
 };
 
@@ -19,7 +43,17 @@ void add_package(struct package *new_package);
 void remove_package(const char *identifier);
 struct package *get_package_list();
 struct package *find_package(const char *identifier);
+struct package *find_package_exact(const char *identifier);
 int load_package(const char *filename);
+int load_package_with_status(const char *filename, const uint8_t *known, int known_nchunks);
 void print_packages();
+int package_has_chunk(struct package *pkg, int index);
+int package_mark_chunk(struct package *pkg, int index);
+long long package_readable(struct package *pkg);
+int package_find_chunk(struct package *pkg, const char *hash);
+int package_data_fd(struct package *pkg);
+int package_read_fd(struct package *pkg);
+int package_commit_chunk(struct package *pkg, int index);
+int package_store(struct package *pkg, int index, uint32_t offset, const uint8_t *data, size_t len);
 
 #endif
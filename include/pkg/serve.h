@@ -0,0 +1,18 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "package.h"
+#include "../net/proto.h"
+#include "../peer/peer.h"
+
+#define SERVE_QUEUE_BYTES (256 * 1024)   // Output queued for a peer before its jobs wait
+
+int serve_request(struct peer *peer, struct btide_req *req);
+int serve_batch(struct peer *peer, struct btide_batch *batch);
+void serve_pump(struct peer *peer);
+void serve_cancel(struct peer *peer, struct btide_batch *batch);
+int serve_advertise(struct peer *peer);
+void serve_advertise_package(struct package *pkg);
+void serve_announce_chunk(struct package *pkg, int index);
+
+#endif
@@ -0,0 +1,83 @@
+#include "../include/pkg/bitmap.h"
+#include <stdlib.h>
+
+#define WORD_INDEX(i) ((i) / BITMAP_WORD_BITS)
+#define WORD_MASK(i) ((uint64_t)1 << ((i) % BITMAP_WORD_BITS))
+
+static uint32_t word_count(uint32_t nbits) {
+    return (nbits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+// Function to allocate an empty bitmap for nbits chunks
+int bitmap_init(struct chunk_bitmap *bm, uint32_t nbits) {
+    bm->nbits = nbits;
+    bm->words = calloc(word_count(nbits) ? word_count(nbits) : 1, sizeof(*bm->words));
+    if (!bm->words) {
+        bm->nbits = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to free the bitmap words
+void bitmap_destroy(struct chunk_bitmap *bm) {
+    free(bm->words);
+    bm->words = NULL;
+    bm->nbits = 0;
+}
+
+// Sets a bit, returns 1 if this call changed it, 0 if it was already set
+int bitmap_set(struct chunk_bitmap *bm, uint32_t index) {
+    if (index >= bm->nbits) {
+        return 0;
+    }
+    uint64_t old = atomic_fetch_or(&bm->words[WORD_INDEX(index)], WORD_MASK(index));
+    return (old & WORD_MASK(index)) == 0;
+}
+
+// Clears a bit, returns 1 if this call changed it, 0 if it was already clear
+int bitmap_clear(struct chunk_bitmap *bm, uint32_t index) {
+    if (index >= bm->nbits) {
+        return 0;
+    }
+    uint64_t old = atomic_fetch_and(&bm->words[WORD_INDEX(index)], ~WORD_MASK(index));
+    return (old & WORD_MASK(index)) != 0;
+}
+
+int bitmap_test(const struct chunk_bitmap *bm, uint32_t index) {
+    if (index >= bm->nbits) {
+        return 0;
+    }
+    return (atomic_load(&bm->words[WORD_INDEX(index)]) & WORD_MASK(index)) != 0;
+}
+
+// Counts the set bits
+uint32_t bitmap_count(const struct chunk_bitmap *bm) {
+    uint32_t count = 0;
+    for (uint32_t w = 0; w < word_count(bm->nbits); w++) {
+        count += __builtin_popcountll(atomic_load(&bm->words[w]));
+    }
+    return count;
+}
+
+// Size of the packed byte form of a bitmap with nbits entries
+size_t bitmap_bytes(uint32_t nbits) {
+    return (nbits + 7) / 8;
+}
+
+// Packs the bitmap into bytes, chunk i is bit (i % 8) of byte (i / 8)
+void bitmap_export(const struct chunk_bitmap *bm, uint8_t *out) {
+    for (size_t b = 0; b < bitmap_bytes(bm->nbits); b++) {
+        uint64_t word = atomic_load(&bm->words[b / 8]);
+        out[b] = (uint8_t)(word >> ((b % 8) * 8));
+    }
+}
+
+// Sets every bit present in the packed byte form, bits past nbits are ignored
+void bitmap_import(struct chunk_bitmap *bm, const uint8_t *in) {
+    for (uint32_t i = 0; i < bm->nbits; i++) {
+        if (in[i / 8] & (1u << (i % 8))) {
+            bitmap_set(bm, i);
+        }
+    }
+}
@@ -1,28 +1,49 @@
+#define _GNU_SOURCE
 #include "../include/net/packet.h"
 #include "../include/peer/peer.h"
+#include "../include/peer/choke.h"
+#include "../include/peer/dial.h"
+#include "../include/peer/local.h"
+#include "../include/peer/udp.h"
 #include "../include/pkg/package.h"
+#include "../include/pkg/journal.h"
+#include "../include/pkg/serve.h"
+#include "../include/pkg/download.h"
+#include "../include/pkg/cache.h"
+#include "../include/net/proto.h"
+#include "../include/net/uring.h"
 #include "../include/chk/pkgchk.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 
-#define MAX_CONN 10
+#define COMMAND_MAX 5520
+#define TICK_MS 100
 
 Config config;
 
-// Listening socket, accepts connections from peers
-void *accept_connections(void *arg) {
-    int listen_socket = *(int *)arg;
-    while (1) {
-        int peer_socket = accept_connection(listen_socket);
-        if (peer_socket >= 0) {
+static struct reactor_handler listen_handler;
+static struct reactor_handler stdin_handler;
+static struct reactor_handler tick_handler;
+static char command_buf[COMMAND_MAX];
+static size_t command_len = 0;
+static int stdin_pipe[2];
+
+// Listening socket, accepts every pending connection from peers
+void on_listen_event(void *ctx, uint32_t events) {
+    int listen_socket = listen_handler.fd;
+    int sockfd;
+    while ((sockfd = accept_connection(listen_socket)) != -1) {
+        if (sockfd >= 0) {
             printf("Accepted connection from peer.\n");
         }
     }
-    return NULL;
 }
 
 // Print peers a user is connected to
@@ -34,13 +55,25 @@ void print_peers() {
         printf("Connected to:\n\n");
         int count = 1;
         while (current) {
-            printf("%d. %s:%d\n", count, current->ip, current->port);
+            printf("%d. %s:%d score %.1f, down %.1f KiB/s, up %.1f KiB/s, failed %d/%d, rtt %.1f ms, %s%s\n",
+                   count, current->ip, current->port, current->score, current->down_rate / 1024,
+                   current->up_rate / 1024, current->req_failed, current->req_ok + current->req_failed,
+                   current->rtt_ms, choke_state(current), current->choking_us ? ", choking us" : "");
             current = current->next;
             count++;
         }
     }
 }
 
+void print_cache() {
+    struct cache_stats stats;
+    cache_get_stats(&stats);
+    uint64_t lookups = stats.hits + stats.misses;
+    printf("Chunk cache: %zu/%zu KiB in %d chunk(s), %llu hit(s), %llu miss(es), %.1f%% hit rate\n",
+           stats.bytes / 1024, stats.capacity / 1024, stats.entries, (unsigned long long)stats.hits,
+           (unsigned long long)stats.misses, lookups ? 100.0 * stats.hits / lookups : 0.0);
+}
+
 // Handles the arguments from FETCH
 void handle_fetch(char *ip_port, char *identifier, char *hash, char *offset_str) {
     if (!ip_port || !identifier || !hash) {
@@ -61,6 +94,10 @@ void handle_fetch(char *ip_port, char *identifier, char *hash, char *offset_str)
         printf("Unable to request chunk, peer not in list\n");
         return;
     }
+    if (peer->choking_us) {
+        printf("Unable to request chunk, peer is choking us\n");
+        return;
+    }
 
     struct package *pkg = find_package(identifier);
     if (!pkg) {
@@ -68,19 +105,17 @@ void handle_fetch(char *ip_port, char *identifier, char *hash, char *offset_str)
         return;
     }
     
-    int chunk_index = -1;
-    for (int i = 0; i < pkg->nchunks; i++) {
-        if (strcmp(pkg->chunks[i].hash, hash) == 0) {
-            chunk_index = i;
-            break;
-        }
-    }
-
+    int chunk_index = package_find_chunk(pkg, hash);
     if (chunk_index == -1) {
         printf("Unable to request chunk, chunk hash does not belong to package.\n");
         return;
     }
 
+    if (package_has_chunk(pkg, chunk_index)) {
+        printf("Chunk already completed, nothing to request.\n");
+        return;
+    }
+
     int offset = offset_str ? atoi(offset_str) : 0;
     if (offset < 0 || offset >= pkg->chunks[chunk_index].size) {
         printf("Invalid offset value.\n");
@@ -88,60 +123,158 @@ void handle_fetch(char *ip_port, char *identifier, char *hash, char *offset_str)
     }
 
     // Send REQ packet to the peer
-    struct btide_packet req_packet;
-    req_packet.msg_code = PKT_MSG_REQ;
-    req_packet.error = 0;
-    snprintf((char *)req_packet.pl.data, sizeof(req_packet.pl.data), 
-    "%u %s %s %s", offset, identifier, hash, offset_str ? offset_str : "0");
+    struct btide_req req = { .offset = offset, .chunk_index = chunk_index };
+    snprintf(req.identifier, sizeof(req.identifier), "%s", pkg->identifier);
+    snprintf(req.chunk_hash, sizeof(req.chunk_hash), "%s", hash);
 
-    if (send_packet(peer->socket, &req_packet) < 0) {
+    // The request waits for window space if too many are outstanding
+    int rc = inflight_submit(peer, &req, pkg->chunks[chunk_index].size - offset);
+    if (rc < 0) {
         printf("Failed to send request packet to peer.\n");
+    } else if (rc == 0) {
+        printf("Request queued for peer %s:%d\n", ip, port);
     } else {
         printf("Request packet sent to peer %s:%d\n", ip, port);
     }
 }
 
-struct chunk *fetch_chunk(const struct package *pkg, const char *hash, uint32_t offset) {
-    for (int i = 0; i < pkg->nchunks; i++) {
-        if (strcmp(pkg->chunks[i].hash, hash) == 0 && pkg->chunks[i].offset == offset) {
-            return &pkg->chunks[i];
+/*
+ * Stores the data of a response into the matching chunk. Only data we
+ * asked for is kept, and it is stored before the request is reported
+ * complete. A chunk whose last byte fails its hash fails the request on
+ * the spot.
+ */
+static void store_response(struct peer *peer, struct btide_res *res, uint16_t error) {
+    if (!error && inflight_expects(peer, res)) {
+        struct package *pkg = find_package_exact(res->identifier);
+        int index = pkg ? package_find_chunk(pkg, res->chunk_hash) : -1;
+        int rc = index >= 0 ? package_store(pkg, index, res->offset, res->data, res->data_len) : -1;
+        if (rc == PACKAGE_STORE_COMMITTED) {
+            serve_announce_chunk(pkg, index);
+        } else if (rc == PACKAGE_STORE_CORRUPT) {
+            printf("Chunk %.16s from %s:%d failed verification\n", res->chunk_hash, peer->ip, peer->port);
+            download_on_corrupt(peer, pkg->identifier, index);
+            error = 1;
         }
     }
-    return NULL;
+    inflight_on_response(peer, res, error);
 }
 
-int store_data(struct chunk *chk, const uint8_t *data, size_t data_len) {
-    if (data_len > chk->size) {
-        fprintf(stderr, "Data length exceeds chunk size\n");
-        return -1;
+void handle_res(struct peer *peer, struct btide_packet *packet) {
+    struct btide_res res;
+    if (res_decode(packet, &res) < 0) {
+        fprintf(stderr, "Malformed response from %s:%d\n", peer->ip, peer->port);
+        return;
     }
+    store_response(peer, &res, packet->error);
+}
 
-    memcpy(chk->data, data, data_len);
+static int read_all(int fd, uint8_t *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
     return 0;
 }
 
+/*
+ * An RFD is a RES whose data we read ourselves from the descriptor that
+ * came with it. The descriptor is taken whatever the frame holds so the
+ * next RFD gets its own.
+ */
+void handle_rfd(struct peer *peer, struct btide_packet *packet) {
+    int fd = peer_take_fd(peer);
+    struct btide_res res;
+    uint64_t file_offset;
+    if (fd < 0 || rfd_decode(packet, &res, &file_offset) < 0 || res.data_len > PKT_BODY_MAX) {
+        fprintf(stderr, "Malformed response from %s:%d\n", peer->ip, peer->port);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    uint16_t error = packet->error;
+    uint8_t *data = NULL;
+    if (!error && inflight_expects(peer, &res)) {
+        data = malloc(res.data_len ? res.data_len : 1);
+        if (!data || read_all(fd, data, res.data_len, (off_t)file_offset) < 0) {
+            fprintf(stderr, "Failed to read chunk %.16s from %s:%d\n", res.chunk_hash, peer->ip, peer->port);
+            error = 1;
+        }
+    }
+    close(fd);
+    res.data = data;
+    store_response(peer, &res, error);
+    free(data);
+}
+
+// Called when a tracked request completes or is given up on
+void on_request_done(struct peer *peer, struct btide_req *req, int status) {
+    download_on_request_done(peer, req, status);
+    if (status == INFLIGHT_FAILED && !peer->closed) {
+        printf("Peer %s:%d could not provide chunk %.16s\n", peer->ip, peer->port, req->chunk_hash);
+    } else if (status == INFLIGHT_TIMEOUT) {
+        printf("Request for chunk %.16s to %s:%d timed out\n", req->chunk_hash, peer->ip, peer->port);
+    }
+}
+
+// Periodic housekeeping, retransmits requests that timed out and keeps downloads fed
+void on_tick(void *ctx, uint32_t events) {
+    uint64_t now = reactor_now_ms();
+    struct peer *current = get_peer_list();
+    while (current) {
+        struct peer *next = current->next;
+        if (peer_keepalive(current, now) == 0) {
+            inflight_check_timeouts(current, now);
+        }
+        current = next;
+    }
+    dial_tick(now);
+    choke_tick(now, !download_active());
+    download_schedule_all();
+}
+
 // Main handling of command flags
 void handle_command(char *command) {
     char *token = strtok(command, " ");
+    if (!token) {
+        return;
+    }
     if (strcmp(token, "CONNECT") == 0) {
+        // Every address given is dialed at once, each reports its own outcome
         char *ip_port = strtok(NULL, " ");
         if (!ip_port) {
             printf("Missing address and port argument.\n");
             return;
         }
-
-        char *ip = strtok(ip_port, ":");
-        char *port_str = strtok(NULL, ":");
-        if (!ip || !port_str) {
-            printf("Missing address and port argument.\n");
-            return;
-        }
-
-        int port = atoi(port_str);
-        if (connect_to_peer(ip, port) >= 0) {
-            printf("Connection established with peer\n");
-        } else {
-            printf("Unable to connect to requested peer.\n");
+        for (; ip_port; ip_port = strtok(NULL, " ")) {
+            if (strncmp(ip_port, "unix:", 5) == 0) {
+                if (local_connect(ip_port + 5) < 0) {
+                    printf("Unable to connect to requested peer.\n");
+                }
+                continue;
+            }
+            int udp = strncmp(ip_port, "udp:", 4) == 0;
+            if (udp) {
+                ip_port += 4;
+            }
+            char *colon = strchr(ip_port, ':');
+            if (!colon || colon == ip_port || colon[1] == '\0') {
+                printf("Missing address and port argument.\n");
+                continue;
+            }
+            *colon = '\0';
+            if ((udp ? udp_connect(ip_port, atoi(colon + 1)) : dial_peer(ip_port, atoi(colon + 1))) < 0) {
+                printf("Unable to connect to requested peer.\n");
+            }
         }
     } else if (strcmp(token, "DISCONNECT") == 0) {
         char *ip_port = strtok(NULL, " ");
@@ -162,6 +295,8 @@ void handle_command(char *command) {
         if (peer) {
             disconnect_peer(peer);
             printf("Disconnected from peer\n");
+        } else if (dial_cancel(ip, port)) {
+            printf("Stopped connecting to peer\n");
         } else {
             printf("Unknown peer, not connected.\n");
         }
@@ -169,6 +304,13 @@ void handle_command(char *command) {
         char *filename = strtok(NULL, " ");
         if (!load_package(filename)) {
             printf("Failed to add package.\n");
+        } else {
+            // The new package is last in the list
+            struct package *pkg = get_package_list();
+            while (pkg->next) {
+                pkg = pkg->next;
+            }
+            serve_advertise_package(pkg);
         }
     } else if (strcmp(token, "REMPACKAGE") == 0) {
         char *ident = strtok(NULL, " ");
@@ -181,6 +323,7 @@ void handle_command(char *command) {
         if (!pkg) {
             printf("Identifier provided does not match managed packages.\n");
         } else {
+            download_cancel(pkg->identifier);
             remove_package(pkg->identifier);
             printf("Package has been removed\n");
         }
@@ -188,6 +331,8 @@ void handle_command(char *command) {
         print_packages();
     } else if (strcmp(token, "PEERS") == 0) {
         print_peers();
+    } else if (strcmp(token, "CACHE") == 0) {
+        print_cache();
     } else if (strcmp(token, "FETCH") == 0) {
         char *ip_port = strtok(NULL, " ");
         char *identifier = strtok(NULL, " ");
@@ -198,6 +343,29 @@ void handle_command(char *command) {
             return;
         }
         handle_fetch(ip_port, identifier, hash, offset);
+    } else if (strcmp(token, "DOWNLOAD") == 0) {
+        char *identifier = strtok(NULL, " ");
+        if (!identifier) {
+            printf("Missing identifier argument\n");
+            return;
+        }
+        download_start(identifier, 0);
+    } else if (strcmp(token, "STREAM") == 0) {
+        char *identifier = strtok(NULL, " ");
+        if (!identifier) {
+            printf("Missing identifier argument\n");
+            return;
+        }
+        download_start(identifier, 1);
+    } else if (strcmp(token, "READABLE") == 0) {
+        char *identifier = strtok(NULL, " ");
+        struct package *pkg = identifier ? find_package(identifier) : NULL;
+        if (!pkg) {
+            printf("Identifier provided does not match managed packages.\n");
+            return;
+        }
+        printf("%.32s, %s/%s : %lld of %d bytes readable\n", pkg->identifier, config.directory, pkg->filename,
+               package_readable(pkg), pkg->size);
     } else if (strcmp(token, "QUIT") == 0) {
         exit(0);
     } else {
@@ -205,15 +373,137 @@ void handle_command(char *command) {
     }
 }
 
-void *monitor_disconnections(void *arg) {
-    while (1) {
-        struct peer *current = get_peer_list();
-        while (current) {
-            check_for_disconnection(current->socket);
-            current = current->next;
+// Records which chunks a peer advertises for a package we manage
+static void handle_availability(struct peer *peer, struct btide_packet *packet) {
+    if (packet->msg_code == PKT_MSG_BFD) {
+        struct btide_bitfield bitfield;
+        struct package *pkg;
+        if (bitfield_decode(packet, &bitfield) == 0 && (pkg = find_package_exact(bitfield.identifier)) &&
+            bitfield.nchunks == (uint32_t)pkg->nchunks) {
+            peer_set_bitfield(peer, pkg->identifier, pkg->nchunks, bitfield.bits);
+        }
+    } else {
+        struct btide_have have;
+        struct package *pkg;
+        if (have_decode(packet, &have) == 0 && (pkg = find_package_exact(have.identifier))) {
+            peer_set_have(peer, pkg->identifier, pkg->nchunks, have.index);
+        }
+    }
+}
+
+// Handles packets from peers, the peer layer has already acted on HEL, DSN, PING and PONG
+void handle_packet(struct peer *peer, struct btide_packet *packet) {
+    switch (packet->msg_code) {
+    case PKT_MSG_HEL:
+        serve_advertise(peer);
+        break;
+    case PKT_MSG_BFD:
+    case PKT_MSG_HAV:
+        handle_availability(peer, packet);
+        break;
+    case PKT_MSG_CHK:
+    case PKT_MSG_UNC:
+        if (peer->features & PKT_FEAT_CHOKE) {
+            choke_on_message(peer, packet);
+        }
+        break;
+    case PKT_MSG_REQ: {
+        // The peer dropped whatever it asked before seeing our CHK
+        if (peer->choked) {
+            break;
+        }
+        struct btide_req req;
+        if (req_decode(packet, &req) < 0) {
+            fprintf(stderr, "Malformed request from %s:%d\n", peer->ip, peer->port);
+            break;
+        }
+        serve_request(peer, &req);
+        break;
+    }
+    case PKT_MSG_CAN: {
+        struct btide_batch batch;
+        if (!(peer->features & PKT_FEAT_CANCEL)) {
+            break;
+        }
+        if (batch_decode(packet, &batch) < 0) {
+            fprintf(stderr, "Malformed cancel from %s:%d\n", peer->ip, peer->port);
+            break;
+        }
+        serve_cancel(peer, &batch);
+        break;
+    }
+    case PKT_MSG_BRQ: {
+        if (peer->choked) {
+            break;
+        }
+        struct btide_batch batch;
+        if (batch_decode(packet, &batch) < 0) {
+            fprintf(stderr, "Malformed request from %s:%d\n", peer->ip, peer->port);
+            break;
+        }
+        serve_batch(peer, &batch);
+        break;
+    }
+    case PKT_MSG_RES:
+        handle_res(peer, packet);
+        break;
+    case PKT_MSG_RFD:
+        handle_rfd(peer, packet);
+        break;
+    case PKT_MSG_ACK:
+    case PKT_MSG_ACP:
+    default:
+        break;
+    }
+}
+
+// Runs every complete line typed on stdin as a command
+void on_stdin_event(void *ctx, uint32_t events) {
+    ssize_t n = read(stdin_handler.fd, command_buf + command_len, sizeof(command_buf) - 1 - command_len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (n <= 0) {
+        // End of input, run a last unterminated command and keep serving peers
+        reactor_del(&stdin_handler);
+        if (command_len > 0) {
+            command_buf[command_len] = 0;
+            command_len = 0;
+            handle_command(command_buf);
         }
-        sleep(1);
+        return;
+    }
+    command_len += n;
+
+    char *start = command_buf;
+    char *newline;
+    while ((newline = memchr(start, '\n', command_buf + command_len - start))) {
+        *newline = 0; // Remove trailing newline
+        handle_command(start);
+        start = newline + 1;
+    }
+    command_len -= start - command_buf;
+    memmove(command_buf, start, command_len);
+
+    // Overlong line, run what fits like fgets would
+    if (command_len == sizeof(command_buf) - 1) {
+        command_buf[command_len] = 0;
+        command_len = 0;
+        handle_command(command_buf);
     }
+}
+
+// Copies stdin into a pipe when stdin itself cannot be polled (regular files)
+void *pump_stdin(void *arg) {
+    int out = *(int *)arg;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, n) != n) {
+            break;
+        }
+    }
+    close(out);
     return NULL;
 }
 
@@ -230,6 +520,27 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
+    // Closed peers are reported by send, not by a signal
+    signal(SIGPIPE, SIG_IGN);
+    // Output must not sit in a buffer while the reactor waits
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (reactor_init() != 0) {
+        exit(1);
+    }
+    if (config.io_engine == IO_ENGINE_URING) {
+        if (uring_init(URING_ENTRIES) != 0) {
+            printf("io_uring unavailable, using epoll.\n");
+        }
+    }
+    cache_init((size_t)config.cache_kib * 1024);
+    if (peer_rate_init() < 0) {
+        exit(1);
+    }
+
+    // Rebuild the package registry from the previous run
+    journal_open(config.directory);
+
     int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
     struct sockaddr_in server_addr;
     server_addr.sin_family = AF_INET;
@@ -241,22 +552,52 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    if (listen(listen_socket, MAX_CONN) < 0) {
+    if (listen(listen_socket, config.max_peers) < 0) {
         perror("Listen failed");
         return 1;
     }
 
-    pthread_t accept_thread, monitor_thread;
-    pthread_create(&accept_thread, NULL, accept_connections, &listen_socket);
-    pthread_create(&monitor_thread, NULL, monitor_disconnections, NULL);
+    // One reactor owns the listening socket, every peer socket and stdin
+    fcntl(listen_socket, F_SETFL, fcntl(listen_socket, F_GETFL) | O_NONBLOCK);
+    listen_handler.fd = listen_socket;
+    listen_handler.fn = on_listen_event;
+    if (reactor_add(&listen_handler, EPOLLIN | EPOLLET) < 0) {
+        perror("epoll_ctl");
+        return 1;
+    }
+    if (config.local_socket[0] && local_listen(config.local_socket) < 0) {
+        return 1;
+    }
+    if (config.udp_transport && udp_listen(config.port) < 0) {
+        return 1;
+    }
+    peer_set_packet_handler(handle_packet);
+    peer_set_drain_handler(serve_pump);
+    peer_set_remove_handler(download_on_peer_removed);
+    inflight_set_done_handler(on_request_done);
 
-    char command[5520];
-    while (1) {
-        fgets(command, sizeof(command), stdin);
-        command[strcspn(command, "\n")] = 0; // Remove trailing newline
-        handle_command(command);
+    tick_handler.fn = on_tick;
+    if (reactor_add_timer(&tick_handler, TICK_MS) < 0) {
+        return 1;
     }
 
+    // stdin is level triggered, it is read once per wakeup and never made non-blocking
+    stdin_handler.fd = STDIN_FILENO;
+    stdin_handler.fn = on_stdin_event;
+    if (reactor_add(&stdin_handler, EPOLLIN) < 0) {
+        pthread_t stdin_thread;
+        if (errno != EPERM || pipe(stdin_pipe) < 0) {
+            perror("epoll_ctl");
+            return 1;
+        }
+        stdin_handler.fd = stdin_pipe[0];
+        reactor_add(&stdin_handler, EPOLLIN);
+        pthread_create(&stdin_thread, NULL, pump_stdin, &stdin_pipe[1]);
+        pthread_detach(stdin_thread);
+    }
+
+    reactor_run();
+
     close(listen_socket);
     return 0;
 }
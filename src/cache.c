@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "../include/pkg/cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Chunks recently read for serving, keyed by their binary SHA-256 so a
+ * chunk shared by two packages is held once. The key picks one of
+ * CACHE_SHARDS shards, each with its own hash table, CLOCK ring and equal
+ * share of the byte budget, which keeps every eviction sweep short.
+ *
+ * Lookups and loads happen on the reactor thread. A miss reads the whole
+ * chunk in one pread whatever range was asked for, so the requests for
+ * that chunk from every peer, and the many ranges of one BRQ, that would
+ * each have gone to disk share that single read.
+ */
+struct cache_entry {
+    uint8_t key[32];
+    uint8_t *data;
+    uint32_t len;
+    int referenced;             // CLOCK bit, set on every hit
+    struct cache_entry *hnext;  // Chain in the shard's hash table
+};
+
+struct cache_shard {
+    struct cache_entry *buckets[CACHE_BUCKETS];
+    struct cache_entry **ring;  // Entries in CLOCK order
+    int count;
+    int cap;
+    int hand;
+    size_t bytes;
+    size_t budget;
+};
+
+static struct cache_shard shards[CACHE_SHARDS];
+static size_t capacity = 0;
+static uint64_t hits = 0;
+static uint64_t misses = 0;
+
+// Sets the byte budget, 0 turns the cache off
+int cache_init(size_t bytes) {
+    capacity = bytes;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        shards[i].budget = bytes / CACHE_SHARDS;
+    }
+    return 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static int parse_key(const char *hash, uint8_t key[32]) {
+    for (int i = 0; i < 32; i++) {
+        int hi = hex_value(hash[2 * i]);
+        int lo = hi < 0 ? -1 : hex_value(hash[2 * i + 1]);
+        if (lo < 0) {
+            return -1;
+        }
+        key[i] = (uint8_t)(hi << 4 | lo);
+    }
+    return 0;
+}
+
+static size_t bucket_of(const uint8_t key[32]) {
+    return (key[1] | key[2] << 8) % CACHE_BUCKETS;
+}
+
+static struct cache_entry *lookup(struct cache_shard *shard, const uint8_t key[32]) {
+    for (struct cache_entry *entry = shard->buckets[bucket_of(key)]; entry; entry = entry->hnext) {
+        if (memcmp(entry->key, key, 32) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Evicts the entry under the hand, the last entry of the ring takes its place
+static void evict(struct cache_shard *shard) {
+    struct cache_entry *victim = shard->ring[shard->hand];
+    struct cache_entry **slot = &shard->buckets[bucket_of(victim->key)];
+    while (*slot != victim) {
+        slot = &(*slot)->hnext;
+    }
+    *slot = victim->hnext;
+
+    shard->ring[shard->hand] = shard->ring[--shard->count];
+    shard->bytes -= victim->len;
+    free(victim->data);
+    free(victim);
+    if (shard->hand >= shard->count) {
+        shard->hand = 0;
+    }
+}
+
+// Sweeps the ring, giving referenced entries a second chance, until len more bytes fit
+static void make_room(struct cache_shard *shard, uint32_t len) {
+    while (shard->count > 0 && shard->bytes + len > shard->budget) {
+        struct cache_entry *entry = shard->ring[shard->hand];
+        if (entry->referenced) {
+            entry->referenced = 0;
+            shard->hand = (shard->hand + 1) % shard->count;
+        } else {
+            evict(shard);
+        }
+    }
+}
+
+static int read_chunk(int fd, off_t offset, uint8_t *buf, uint32_t len) {
+    uint32_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/*
+ * Points *data at the len bytes of the chunk with the given hash, reading
+ * them from fd at offset on a miss. The pointer is valid until the next
+ * cache call. Returns 1 on success, 0 if the chunk is not cached because
+ * the cache is off or the chunk would not fit a shard, -1 if the read
+ * failed.
+ */
+int cache_get(const char *hash, int fd, off_t offset, uint32_t len, const uint8_t **data) {
+    uint8_t key[32];
+    if (capacity == 0 || parse_key(hash, key) < 0) {
+        return 0;
+    }
+    struct cache_shard *shard = &shards[key[0] % CACHE_SHARDS];
+    if (len == 0 || len > shard->budget) {
+        return 0;
+    }
+
+    struct cache_entry *entry = lookup(shard, key);
+    if (entry && entry->len == len) {
+        entry->referenced = 1;
+        hits++;
+        *data = entry->data;
+        return 1;
+    }
+    misses++;
+
+    uint8_t *buf = malloc(len);
+    if (!buf) {
+        return 0;
+    }
+    if (read_chunk(fd, offset, buf, len) < 0) {
+        free(buf);
+        return -1;
+    }
+    if (entry) {
+        // Same digest with another size, only a malformed package gets here
+        free(entry->data);
+        shard->bytes -= entry->len;
+        entry->data = buf;
+        entry->len = len;
+        shard->bytes += len;
+        *data = buf;
+        return 1;
+    }
+
+    make_room(shard, len);
+    if (shard->count == shard->cap) {
+        int cap = shard->cap ? shard->cap * 2 : 16;
+        struct cache_entry **ring = realloc(shard->ring, cap * sizeof(struct cache_entry *));
+        if (!ring) {
+            free(buf);
+            return 0;
+        }
+        shard->ring = ring;
+        shard->cap = cap;
+    }
+    entry = malloc(sizeof(struct cache_entry));
+    if (!entry) {
+        free(buf);
+        return 0;
+    }
+    memcpy(entry->key, key, 32);
+    entry->data = buf;
+    entry->len = len;
+    entry->referenced = 0;
+    entry->hnext = shard->buckets[bucket_of(key)];
+    shard->buckets[bucket_of(key)] = entry;
+    shard->ring[shard->count++] = entry;
+    shard->bytes += len;
+
+    *data = buf;
+    return 1;
+}
+
+void cache_get_stats(struct cache_stats *stats) {
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->bytes = 0;
+    stats->entries = 0;
+    stats->capacity = capacity;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        stats->bytes += shards[i].bytes;
+        stats->entries += shards[i].count;
+    }
+}
@@ -315,6 +315,47 @@ struct bpkg_query bpkg_get_completed_chunks(struct bpkg_obj* bpkg) {
     return qry;
 }
 
+/**
+ * Verifies every chunk of the data file against its leaf hash.
+ * 
+ * @param bpkg Pointer to the package object.
+ * @param status Array of nchunks entries, set to 1 for each valid chunk.
+ * @return Number of valid chunks, or -1 if the data file could not be hashed.
+ */
+int bpkg_get_chunk_status(struct bpkg_obj* bpkg, uint8_t* status) {
+    if (!bpkg || !status) {
+        return -1;
+    }
+
+    size_t* chunk_sizes = malloc(bpkg->nchunks * sizeof(size_t));
+    if (!chunk_sizes) {
+        fprintf(stderr, "Failed to allocate memory for chunk sizes.\n");
+        return -1;
+    }
+
+    for (int i = 0; i < bpkg->nchunks; i++) {
+        chunk_sizes[i] = bpkg->chunks[i].size;
+    }
+
+    struct merkle_tree* tree = build_merkle_tree_from_data(bpkg, chunk_sizes, bpkg->nchunks);
+    free(chunk_sizes);
+
+    if (!tree) {
+        return -1;
+    }
+
+    // Compare each computed leaf with the hash recorded in the package
+    int count = 0;
+    for (int i = 0; i < bpkg->nchunks; i++) {
+        int leaf_index = tree->n_leaves - 1 + i;
+        status[i] = tree->hashes[leaf_index] && strcmp(tree->hashes[leaf_index], bpkg->chunks[i].hash) == 0;
+        count += status[i];
+    }
+
+    destroy_merkle_tree(tree);
+    return count;
+}
+
 /**
  * Retrieves the minimum set of hashes representing the current completion state.
  * 
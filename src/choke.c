@@ -0,0 +1,151 @@
+#include "../include/peer/choke.h"
+#include "../include/config/config.h"
+#include <stdlib.h>
+
+/*
+ * Every CHOKE_INTERVAL_MS the peers that understand CHK and UNC are ranked
+ * by score and the best upload_slots of them are served, the rest choked.
+ * One more slot goes to a choked peer picked at random, newcomers three
+ * times as likely, so a peer with nothing to show yet can earn a place.
+ * It moves every CHOKE_OPTIMISTIC_ROUNDS rechokes. Legacy peers are never
+ * choked since they would only see their requests time out.
+ */
+extern Config config;
+static uint64_t last_rechoke_ms = 0;
+static int rounds = 0;
+
+/*
+ * While downloading a peer is worth what it gives us, while seeding what it
+ * takes, since that spreads the package fastest. Rates are in KiB/s,
+ * scaled down by the share of our requests the peer failed. RTT only
+ * breaks ties. It is timed from when the PING was written, so our own
+ * queued output to the peer does not count against it.
+ */
+static double peer_score(struct peer *peer, int seeding) {
+    double rate = seeding ? peer->up_rate : peer->down_rate;
+    double reliability = (peer->req_ok + 1.0) / (peer->req_ok + peer->req_failed + 1.0);
+    return rate / 1024 * reliability;
+}
+
+static void update_rates(struct peer *peer, double secs, int seeding) {
+    double down = (peer->rx_bytes - peer->rx_mark) / secs;
+    double up = (peer->tx_bytes - peer->tx_mark) / secs;
+    peer->rx_mark = peer->rx_bytes;
+    peer->tx_mark = peer->tx_bytes;
+    peer->down_rate = 0.5 * peer->down_rate + 0.5 * down;
+    peer->up_rate = 0.5 * peer->up_rate + 0.5 * up;
+    peer->score = peer_score(peer, seeding);
+}
+
+// Highest score first, then what the peer takes from us, then the shorter RTT
+static int compare_peers(const void *a, const void *b) {
+    const struct peer *x = *(struct peer *const *)a, *y = *(struct peer *const *)b;
+    if (x->score != y->score) {
+        return x->score < y->score ? 1 : -1;
+    }
+    if (x->up_rate != y->up_rate) {
+        return x->up_rate < y->up_rate ? 1 : -1;
+    }
+    if (x->rtt_ms != y->rtt_ms) {
+        return x->rtt_ms > y->rtt_ms ? 1 : -1;
+    }
+    return 0;
+}
+
+static void set_choked(struct peer *peer, int choked) {
+    if (peer->choked == choked) {
+        return;
+    }
+    peer->choked = choked;
+    // The peer drops its requests on CHK, so the ranges not yet sent go too
+    if (choked) {
+        peer_drop_jobs(peer);
+    }
+    struct btide_packet packet;
+    packet_init(&packet, choked ? PKT_MSG_CHK : PKT_MSG_UNC);
+    peer_send(peer, &packet);
+}
+
+// Picks a choked peer at random, weighting those that connected recently
+static struct peer *pick_optimistic(struct peer **peers, int from, int count, uint64_t now) {
+    int total = 0;
+    for (int i = from; i < count; i++) {
+        total += now - peers[i]->connected_ms < CHOKE_NEWCOMER_MS ? 3 : 1;
+    }
+    if (total == 0) {
+        return NULL;
+    }
+    int pick = rand() % total;
+    for (int i = from; i < count; i++) {
+        pick -= now - peers[i]->connected_ms < CHOKE_NEWCOMER_MS ? 3 : 1;
+        if (pick < 0) {
+            return peers[i];
+        }
+    }
+    return NULL;
+}
+
+// Rescores every peer and reassigns the upload slots, run from the tick
+void choke_tick(uint64_t now, int seeding) {
+    if (now - last_rechoke_ms < CHOKE_INTERVAL_MS) {
+        return;
+    }
+    double secs = last_rechoke_ms ? (now - last_rechoke_ms) / 1000.0 : CHOKE_INTERVAL_MS / 1000.0;
+    last_rechoke_ms = now;
+
+    struct peer **peers = malloc((peer_count() + 1) * sizeof(struct peer *));
+    if (!peers) {
+        return;
+    }
+    int count = 0;
+    struct peer *optimistic = NULL;
+    for (struct peer *peer = get_peer_list(); peer; peer = peer->next) {
+        update_rates(peer, secs, seeding);
+        if (peer->features & PKT_FEAT_CHOKE) {
+            peers[count++] = peer;
+            if (peer->optimistic) {
+                optimistic = peer;
+            }
+        }
+    }
+    qsort(peers, count, sizeof(struct peer *), compare_peers);
+
+    int slots = config.upload_slots < count ? config.upload_slots : count;
+    for (int i = 0; i < slots; i++) {
+        if (peers[i] == optimistic) {
+            // Earned a regular slot, the trial goes to someone else
+            optimistic = NULL;
+        }
+    }
+    if (rounds++ % CHOKE_OPTIMISTIC_ROUNDS == 0 || !optimistic) {
+        optimistic = pick_optimistic(peers, slots, count, now);
+    }
+
+    for (int i = 0; i < count; i++) {
+        peers[i]->optimistic = peers[i] == optimistic;
+        set_choked(peers[i], i >= slots && !peers[i]->optimistic);
+    }
+    free(peers);
+}
+
+/*
+ * A peer that chokes us drops whatever we ask until it unchokes, so every
+ * request to it goes back to the scheduler for other peers.
+ */
+void choke_on_message(struct peer *peer, struct btide_packet *packet) {
+    if (packet->msg_code == PKT_MSG_CHK) {
+        if (!peer->choking_us) {
+            peer->choking_us = 1;
+            inflight_release(peer);
+        }
+    } else {
+        peer->choking_us = 0;
+    }
+}
+
+const char *choke_state(struct peer *peer) {
+    if (peer->choked) {
+        return "choked";
+    }
+    return peer->optimistic ? "optimistic" : "unchoked";
+}
@@ -47,6 +47,23 @@ int load_config(const char* filepath, Config* cfg) {
         return 1;
     }
 
+    // Optional settings
+    cfg->max_peers = DEFAULT_MAX_PEERS;
+    cfg->request_window = DEFAULT_REQUEST_WINDOW;
+    cfg->peer_queue_kib = DEFAULT_PEER_QUEUE_KIB;
+    cfg->io_engine = IO_ENGINE_EPOLL;
+    cfg->upload_kibps = 0;
+    cfg->download_kibps = 0;
+    cfg->peer_upload_kibps = 0;
+    cfg->peer_download_kibps = 0;
+    cfg->upload_slots = DEFAULT_UPLOAD_SLOTS;
+    cfg->cache_kib = DEFAULT_CACHE_KIB;
+    cfg->readahead_kib = DEFAULT_READAHEAD_KIB;
+    cfg->connect_timeout_ms = DEFAULT_CONNECT_TIMEOUT_MS;
+    cfg->local_socket[0] = '\0';
+    cfg->udp_transport = 0;
+    cfg->udp_loss_percent = 0;
+
     char line[1024];
     while (fgets(line, sizeof(line), file)) {
         char* token = strtok(line, ":");
@@ -72,6 +89,93 @@ int load_config(const char* filepath, Config* cfg) {
                         fprintf(stderr, "Invalid port: %u\n", cfg->port);
                         return 5;
                     }
+                } else if (strcmp(key, "request_window") == 0) {
+                    cfg->request_window = atoi(value);
+                    if (cfg->request_window < 1 || cfg->request_window > 1024) {
+                        fprintf(stderr, "Invalid request_window: %d\n", cfg->request_window);
+                        return 6;
+                    }
+                } else if (strcmp(key, "peer_queue_kib") == 0) {
+                    cfg->peer_queue_kib = atoi(value);
+                    if (cfg->peer_queue_kib < 64 || cfg->peer_queue_kib > 1048576) {
+                        fprintf(stderr, "Invalid peer_queue_kib: %d\n", cfg->peer_queue_kib);
+                        return 7;
+                    }
+                } else if (strcmp(key, "io_engine") == 0) {
+                    if (strcmp(value, "epoll") == 0) {
+                        cfg->io_engine = IO_ENGINE_EPOLL;
+                    } else if (strcmp(value, "io_uring") == 0) {
+                        cfg->io_engine = IO_ENGINE_URING;
+                    } else {
+                        fprintf(stderr, "Invalid io_engine: %s\n", value);
+                        return 8;
+                    }
+                } else if (strcmp(key, "upload_kibps") == 0) {
+                    cfg->upload_kibps = atoi(value);
+                    if (cfg->upload_kibps < 0 || cfg->upload_kibps > MAX_RATE_KIBPS) {
+                        fprintf(stderr, "Invalid upload_kibps: %d\n", cfg->upload_kibps);
+                        return 9;
+                    }
+                } else if (strcmp(key, "download_kibps") == 0) {
+                    cfg->download_kibps = atoi(value);
+                    if (cfg->download_kibps < 0 || cfg->download_kibps > MAX_RATE_KIBPS) {
+                        fprintf(stderr, "Invalid download_kibps: %d\n", cfg->download_kibps);
+                        return 10;
+                    }
+                } else if (strcmp(key, "peer_upload_kibps") == 0) {
+                    cfg->peer_upload_kibps = atoi(value);
+                    if (cfg->peer_upload_kibps < 0 || cfg->peer_upload_kibps > MAX_RATE_KIBPS) {
+                        fprintf(stderr, "Invalid peer_upload_kibps: %d\n", cfg->peer_upload_kibps);
+                        return 11;
+                    }
+                } else if (strcmp(key, "peer_download_kibps") == 0) {
+                    cfg->peer_download_kibps = atoi(value);
+                    if (cfg->peer_download_kibps < 0 || cfg->peer_download_kibps > MAX_RATE_KIBPS) {
+                        fprintf(stderr, "Invalid peer_download_kibps: %d\n", cfg->peer_download_kibps);
+                        return 12;
+                    }
+                } else if (strcmp(key, "upload_slots") == 0) {
+                    cfg->upload_slots = atoi(value);
+                    if (cfg->upload_slots < 1 || cfg->upload_slots > 1024) {
+                        fprintf(stderr, "Invalid upload_slots: %d\n", cfg->upload_slots);
+                        return 13;
+                    }
+                } else if (strcmp(key, "cache_kib") == 0) {
+                    cfg->cache_kib = atoi(value);
+                    if (cfg->cache_kib < 0 || cfg->cache_kib > 16777216) {
+                        fprintf(stderr, "Invalid cache_kib: %d\n", cfg->cache_kib);
+                        return 14;
+                    }
+                } else if (strcmp(key, "readahead_kib") == 0) {
+                    cfg->readahead_kib = atoi(value);
+                    if (cfg->readahead_kib < 1 || cfg->readahead_kib > 16777216) {
+                        fprintf(stderr, "Invalid readahead_kib: %d\n", cfg->readahead_kib);
+                        return 15;
+                    }
+                } else if (strcmp(key, "connect_timeout_ms") == 0) {
+                    cfg->connect_timeout_ms = atoi(value);
+                    if (cfg->connect_timeout_ms < 100 || cfg->connect_timeout_ms > 600000) {
+                        fprintf(stderr, "Invalid connect_timeout_ms: %d\n", cfg->connect_timeout_ms);
+                        return 16;
+                    }
+                } else if (strcmp(key, "local_socket") == 0) {
+                    if (strlen(value) == 0 || strlen(value) >= sizeof(cfg->local_socket)) {
+                        fprintf(stderr, "Invalid local_socket: %s\n", value);
+                        return 17;
+                    }
+                    strcpy(cfg->local_socket, value);
+                } else if (strcmp(key, "udp_transport") == 0) {
+                    cfg->udp_transport = atoi(value);
+                    if (cfg->udp_transport != 0 && cfg->udp_transport != 1) {
+                        fprintf(stderr, "Invalid udp_transport: %d\n", cfg->udp_transport);
+                        return 18;
+                    }
+                } else if (strcmp(key, "udp_loss_percent") == 0) {
+                    cfg->udp_loss_percent = atoi(value);
+                    if (cfg->udp_loss_percent < 0 || cfg->udp_loss_percent > 90) {
+                        fprintf(stderr, "Invalid udp_loss_percent: %d\n", cfg->udp_loss_percent);
+                        return 19;
+                    }
                 } else {
                     fprintf(stderr, "Unrecognized configuration line: %s\n", line);
                 }
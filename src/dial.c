@@ -0,0 +1,277 @@
+#include "../include/peer/dial.h"
+#include "../include/config/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+/*
+ * Outgoing connections in progress. Each connect is non-blocking and
+ * waits for its socket to turn writable on the reactor, so any number
+ * dial in parallel and none holds up the loop. dial_tick gives up on
+ * those older than connect_timeout_ms and starts the reconnects whose
+ * backoff is over. Like peers, a dial is unlinked at once and freed after
+ * the current event batch.
+ */
+struct dial {
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    int socket;             // -1 while waiting to reconnect
+    int watched;            // The socket is registered with the reactor
+    int retries;            // Reconnects so far, 0 for a dial asked for by CONNECT
+    uint64_t deadline_ms;   // When the connect times out, or when the reconnect starts
+    struct reactor_handler handler;
+    struct dial *next;
+};
+
+extern Config config;
+static struct dial *dial_list = NULL;
+static int ndials = 0;
+
+static struct dial *find_dial(const char *ip, int port) {
+    struct dial *current = dial_list;
+    while (current && (strcmp(current->ip, ip) != 0 || current->port != port)) {
+        current = current->next;
+    }
+    return current;
+}
+
+static void unlink_dial(struct dial *dial) {
+    struct dial **current = &dial_list;
+    while (*current && *current != dial) {
+        current = &(*current)->next;
+    }
+    if (*current) {
+        *current = dial->next;
+        ndials--;
+    }
+}
+
+// A connect that completed at once never reached the reactor
+static void unwatch_dial(struct dial *dial) {
+    if (dial->watched) {
+        reactor_del(&dial->handler);
+        dial->watched = 0;
+    }
+}
+
+static void close_dial(struct dial *dial) {
+    if (dial->socket >= 0) {
+        unwatch_dial(dial);
+        close(dial->socket);
+        dial->socket = -1;
+    }
+}
+
+static void end_dial(struct dial *dial) {
+    close_dial(dial);
+    unlink_dial(dial);
+    reactor_defer_free(dial, free);
+}
+
+// Doubles from DIAL_BACKOFF_MIN_MS per reconnect, with up to a quarter more so peers do not retry in step
+static uint64_t backoff_ms(int retries) {
+    uint64_t ms = DIAL_BACKOFF_MAX_MS;
+    if (retries - 1 < 16 && ((uint64_t)DIAL_BACKOFF_MIN_MS << (retries - 1)) < DIAL_BACKOFF_MAX_MS) {
+        ms = (uint64_t)DIAL_BACKOFF_MIN_MS << (retries - 1);
+    }
+    return ms + rand() % (ms / 4 + 1);
+}
+
+// Reports a failed attempt, a reconnect is tried again later until DIAL_MAX_RETRIES
+static void dial_failed(struct dial *dial, int err) {
+    close_dial(dial);
+    if (dial->retries == 0) {
+        printf("Connection to %s:%d failed: %s\n", dial->ip, dial->port, strerror(err));
+        printf("Unable to connect to requested peer.\n");
+        end_dial(dial);
+    } else if (dial->retries >= DIAL_MAX_RETRIES) {
+        printf("Giving up on %s:%d after %d reconnects\n", dial->ip, dial->port, dial->retries);
+        end_dial(dial);
+    } else {
+        dial->retries++;
+        dial->deadline_ms = reactor_now_ms() + backoff_ms(dial->retries);
+    }
+}
+
+// Turns the connected socket into a peer
+static void dial_done(struct dial *dial) {
+    unwatch_dial(dial);
+    int sockfd = dial->socket;
+    dial->socket = -1;
+
+    if (peer_count() >= config.max_peers) {
+        printf("Peer limit of %d reached.\n", config.max_peers);
+        close(sockfd);
+    } else {
+        struct peer *peer = peer_register(sockfd, dial->ip, dial->port);
+        if (peer) {
+            peer->redial = 1;
+            peer->retries = dial->retries;
+            if (dial->retries == 0) {
+                printf("Connection established with peer\n");
+            } else {
+                printf("Reconnected to %s:%d\n", dial->ip, dial->port);
+            }
+        }
+    }
+    end_dial(dial);
+}
+
+static void dial_on_event(void *ctx, uint32_t events) {
+    struct dial *dial = ctx;
+    if (dial->socket < 0) {
+        return;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(dial->socket, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        err = errno;
+    }
+    if (err == EINPROGRESS || (err == 0 && !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))) {
+        return;
+    }
+    if (err == 0) {
+        dial_done(dial);
+    } else {
+        dial_failed(dial, err);
+    }
+}
+
+// Starts a non-blocking connect, its result arrives on the reactor
+static void dial_start(struct dial *dial) {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(dial->port);
+    inet_pton(AF_INET, dial->ip, &server_addr.sin_addr);
+
+    dial->socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (dial->socket < 0) {
+        dial_failed(dial, errno);
+        return;
+    }
+    dial->deadline_ms = reactor_now_ms() + config.connect_timeout_ms;
+    if (connect(dial->socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0) {
+        dial_done(dial);
+        return;
+    }
+    int err = errno;
+    if (err != EINPROGRESS) {
+        close(dial->socket);
+        dial->socket = -1;
+        dial_failed(dial, err);
+        return;
+    }
+
+    dial->handler.fd = dial->socket;
+    dial->handler.fn = dial_on_event;
+    dial->handler.ctx = dial;
+    if (reactor_add(&dial->handler, EPOLLOUT | EPOLLET) < 0) {
+        err = errno;
+        close(dial->socket);
+        dial->socket = -1;
+        dial_failed(dial, err);
+        return;
+    }
+    dial->watched = 1;
+}
+
+static struct dial *new_dial(const char *ip, int port, int retries) {
+    struct dial *dial = calloc(1, sizeof(struct dial));
+    if (!dial) {
+        fprintf(stderr, "Failed to allocate connection\n");
+        return NULL;
+    }
+    snprintf(dial->ip, sizeof(dial->ip), "%s", ip);
+    dial->port = port;
+    dial->socket = -1;
+    dial->retries = retries;
+    dial->next = dial_list;
+    dial_list = dial;
+    ndials++;
+    return dial;
+}
+
+/*
+ * Function to connect to a peer. Returns 0 once the connect is under way,
+ * the outcome is printed when it completes, or -1 if it could not start.
+ */
+int dial_peer(const char *ip, int port) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, ip, &addr) <= 0 || port <= 0 || port > 65535) {
+        printf("Invalid address/Address not supported: %s:%d\n", ip, port);
+        return -1;
+    }
+    struct dial *pending = find_dial(ip, port);
+    if (pending && pending->retries == 0) {
+        printf("Already connecting to %s:%d\n", ip, port);
+        return -1;
+    }
+    if (pending) {
+        // Asked for again, the waiting reconnect starts now
+        unlink_dial(pending);
+        close_dial(pending);
+        reactor_defer_free(pending, free);
+    }
+    if (peer_count() + ndials >= config.max_peers) {
+        printf("Peer limit of %d reached.\n", config.max_peers);
+        return -1;
+    }
+
+    struct dial *dial = new_dial(ip, port, 0);
+    if (!dial) {
+        return -1;
+    }
+    dial_start(dial);
+    return 0;
+}
+
+// Schedules a reconnect to a peer we dialed that dropped, retries counts those already made
+void dial_retry(const char *ip, int port, int retries) {
+    if (find_dial(ip, port) || find_peer(ip, port)) {
+        return;
+    }
+    if (retries >= DIAL_MAX_RETRIES) {
+        printf("Giving up on %s:%d after %d reconnects\n", ip, port, retries);
+        return;
+    }
+    struct dial *dial = new_dial(ip, port, retries + 1);
+    if (dial) {
+        dial->deadline_ms = reactor_now_ms() + backoff_ms(dial->retries);
+        printf("Reconnecting to %s:%d in %.1f s\n", ip, port, (dial->deadline_ms - reactor_now_ms()) / 1000.0);
+    }
+}
+
+// Stops a connect or reconnect in progress, returns 1 if there was one
+int dial_cancel(const char *ip, int port) {
+    struct dial *dial = find_dial(ip, port);
+    if (!dial) {
+        return 0;
+    }
+    end_dial(dial);
+    return 1;
+}
+
+int dial_pending() {
+    return ndials;
+}
+
+// Times out slow connects and starts the reconnects that are due
+void dial_tick(uint64_t now) {
+    struct dial *current = dial_list;
+    while (current) {
+        struct dial *next = current->next;
+        if (now >= current->deadline_ms) {
+            if (current->socket >= 0) {
+                dial_failed(current, ETIMEDOUT);
+            } else {
+                dial_start(current);
+            }
+        }
+        current = next;
+    }
+}
@@ -0,0 +1,501 @@
+#include "../include/pkg/download.h"
+#include "../include/pkg/serve.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct candidate {
+    int index;
+    int ahead;      // Within a streaming download's read-ahead window
+    int holders;    // Connected peers that may have the chunk
+    int tiebreak;
+};
+
+static struct download *download_list = NULL;
+extern Config config;
+
+struct download *find_download(const char *identifier) {
+    struct download *current = download_list;
+    while (current && strcmp(current->pkg->identifier, identifier) != 0) {
+        current = current->next;
+    }
+    return current;
+}
+
+static void free_download(struct download *dl) {
+    free(dl->blocks);
+    free(dl->first_block);
+    free(dl->order);
+    free(dl);
+}
+
+// Splits every chunk larger than DOWNLOAD_BLOCK_SIZE into blocks of that size
+static int split_blocks(struct download *dl) {
+    struct package *pkg = dl->pkg;
+    dl->first_block = malloc((pkg->nchunks + 1) * sizeof(int));
+    if (!dl->first_block) {
+        return -1;
+    }
+    int nblocks = 0;
+    for (int i = 0; i < pkg->nchunks; i++) {
+        dl->first_block[i] = nblocks;
+        uint32_t size = pkg->chunks[i].size;
+        nblocks += size > DOWNLOAD_BLOCK_SIZE ? (size + DOWNLOAD_BLOCK_SIZE - 1) / DOWNLOAD_BLOCK_SIZE : 1;
+    }
+    dl->first_block[pkg->nchunks] = nblocks;
+
+    dl->blocks = calloc(nblocks, sizeof(struct download_block));
+    if (!dl->blocks) {
+        return -1;
+    }
+    for (int i = 0; i < pkg->nchunks; i++) {
+        uint32_t size = pkg->chunks[i].size;
+        for (int b = dl->first_block[i]; b < dl->first_block[i + 1]; b++) {
+            uint32_t offset = (uint32_t)(b - dl->first_block[i]) * DOWNLOAD_BLOCK_SIZE;
+            dl->blocks[b].offset = offset;
+            dl->blocks[b].len = size - offset < DOWNLOAD_BLOCK_SIZE ? size - offset : DOWNLOAD_BLOCK_SIZE;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function to start fetching every missing chunk of a managed package.
+ * Streaming fetches the chunks after the readable prefix in file order,
+ * and asking for it on a running download switches that one over.
+ */
+int download_start(const char *identifier, int streaming) {
+    struct package *pkg = find_package(identifier);
+    if (!pkg) {
+        printf("Unable to download, package is not managed\n");
+        return -1;
+    }
+    struct download *running = find_download(pkg->identifier);
+    if (running && streaming && !running->streaming) {
+        running->streaming = 1;
+        printf("Streaming %.32s\n", pkg->identifier);
+        download_schedule_all();
+        return 0;
+    }
+    if (running) {
+        printf("Package is already downloading\n");
+        return -1;
+    }
+    int missing = pkg->nchunks - atomic_load(&pkg->completed_chunks);
+    if (missing == 0) {
+        printf("Package is already complete\n");
+        return -1;
+    }
+
+    struct download *dl = calloc(1, sizeof(struct download));
+    if (!dl) {
+        return -1;
+    }
+    dl->pkg = pkg;
+    dl->streaming = streaming;
+    dl->order = malloc(pkg->nchunks * sizeof(int));
+    if (!dl->order || split_blocks(dl) < 0) {
+        free_download(dl);
+        return -1;
+    }
+    dl->next = download_list;
+    download_list = dl;
+
+    printf("Downloading %d missing chunk(s) of %.32s\n", missing, pkg->identifier);
+    download_schedule_all();
+    return 0;
+}
+
+static void unlink_download(struct download *dl) {
+    struct download **current = &download_list;
+    while (*current && *current != dl) {
+        current = &(*current)->next;
+    }
+    if (*current) {
+        *current = dl->next;
+    }
+}
+
+// Function to stop a download, requests already sent are left to finish
+void download_cancel(const char *identifier) {
+    struct download *dl = find_download(identifier);
+    if (!dl) {
+        return;
+    }
+    for (int i = 0; i < dl->pkg->nchunks; i++) {
+        for (int b = dl->first_block[i]; b < dl->first_block[i + 1]; b++) {
+            struct download_block *blk = &dl->blocks[b];
+            if (blk->assigned) {
+                inflight_cancel_queued(blk->assigned, dl->pkg->identifier, dl->pkg->chunks[i].hash, blk->offset,
+                                       blk->len);
+            }
+        }
+    }
+    unlink_download(dl);
+    free_download(dl);
+}
+
+static int compare_candidates(const void *a, const void *b) {
+    const struct candidate *x = a, *y = b;
+    if (x->ahead != y->ahead) {
+        return y->ahead - x->ahead;
+    }
+    if (x->ahead) {
+        return x->index - y->index;
+    }
+    if (x->holders != y->holders) {
+        return x->holders - y->holders;
+    }
+    return x->tiebreak - y->tiebreak;
+}
+
+// Spare request slots, enough to keep the peer's window full, none while it chokes us
+static int peer_capacity(struct peer *peer) {
+    if (peer->choking_us) {
+        return 0;
+    }
+    return inflight_window(&peer->inflight) + 1 - inflight_load(&peer->inflight);
+}
+
+// Takes work back from peers that have sat on it too long without sending it
+static void reclaim_stalled(struct download *dl, uint64_t now) {
+    for (int i = 0; i < dl->pkg->nchunks; i++) {
+        for (int b = dl->first_block[i]; b < dl->first_block[i + 1]; b++) {
+            struct download_block *blk = &dl->blocks[b];
+            if (blk->assigned && now - blk->assigned_ms > DOWNLOAD_STALL_MS &&
+                inflight_cancel_queued(blk->assigned, dl->pkg->identifier, dl->pkg->chunks[i].hash, blk->offset,
+                                       blk->len)) {
+                blk->assigned = NULL;
+            }
+        }
+    }
+}
+
+// Blocks of chunks not yet verified that have not arrived
+static int missing_blocks(struct download *dl) {
+    int missing = 0;
+    for (int i = 0; i < dl->pkg->nchunks; i++) {
+        for (int b = dl->first_block[i]; b < dl->first_block[i + 1] && !package_has_chunk(dl->pkg, i); b++) {
+            missing += !dl->blocks[b].done;
+        }
+    }
+    return missing;
+}
+
+// A text REQ is answered to the end of the chunk, only peers taking BRQ can be asked for a block before it
+static int can_serve(struct peer *peer, struct chunk *chk, struct download_block *blk) {
+    return (peer->features & PKT_FEAT_BATCH) || blk->offset + blk->len == chk->size;
+}
+
+// More room wins, equal room goes to the peer with the shorter PING round trip
+static int better_peer(struct peer *peer, int room, struct peer *best, int best_room) {
+    if (room != best_room || room <= 0) {
+        return room > best_room;
+    }
+    return peer->rtt_ms > 0 && (best->rtt_ms == 0 || peer->rtt_ms < best->rtt_ms);
+}
+
+// Returns 1 if the chunk starts within readahead_kib of a streaming download's readable prefix
+static int ahead(struct download *dl, int index) {
+    return dl->streaming &&
+           dl->pkg->chunks[index].offset < package_readable(dl->pkg) + (long long)config.readahead_kib * 1024;
+}
+
+/*
+ * Orders missing chunks rarest first, the order is reused until the next
+ * tick. A streaming download puts the chunks in its read-ahead window
+ * ahead of the rest, in file order.
+ */
+static void rank_chunks(struct download *dl) {
+    struct package *pkg = dl->pkg;
+    struct candidate *candidates = malloc(pkg->nchunks * sizeof(struct candidate));
+    if (!candidates) {
+        return;
+    }
+
+    int ncandidates = 0;
+    for (int i = 0; i < pkg->nchunks; i++) {
+        if (package_has_chunk(pkg, i)) {
+            continue;
+        }
+        int holders = 0;
+        for (struct peer *peer = get_peer_list(); peer; peer = peer->next) {
+            holders += peer_may_have(peer, pkg->identifier, i);
+        }
+        if (holders > 0) {
+            candidates[ncandidates].index = i;
+            candidates[ncandidates].ahead = ahead(dl, i);
+            candidates[ncandidates].holders = holders;
+            candidates[ncandidates].tiebreak = rand();
+            ncandidates++;
+        }
+    }
+    qsort(candidates, ncandidates, sizeof(struct candidate), compare_candidates);
+
+    for (int c = 0; c < ncandidates; c++) {
+        dl->order[c] = candidates[c].index;
+    }
+    dl->norder = ncandidates;
+    free(candidates);
+}
+
+// Peers a request for the block is outstanding or waiting with
+static int requested_from(struct download *dl, int index, struct download_block *blk) {
+    int count = 0;
+    for (struct peer *peer = get_peer_list(); peer; peer = peer->next) {
+        count += inflight_has(peer, dl->pkg->identifier, dl->pkg->chunks[index].hash, blk->offset, blk->len);
+    }
+    return count;
+}
+
+/*
+ * Hands one block to the best peer for it, returns 1 if a request was
+ * queued. Past a streaming download's read-ahead window only idle peers
+ * are used, so nothing is queued in front of the blocks the reader waits on.
+ */
+static int schedule_block(struct download *dl, int index, struct download_block *blk, uint64_t now) {
+    struct package *pkg = dl->pkg;
+    struct chunk *chk = &pkg->chunks[index];
+    if (blk->assigned && (!dl->endgame || requested_from(dl, index, blk) >= DOWNLOAD_ENDGAME_PEERS)) {
+        return 0;
+    }
+
+    int idle_only = dl->streaming && !ahead(dl, index);
+    struct peer *best = NULL;
+    int best_room = 0;
+    for (struct peer *peer = get_peer_list(); peer; peer = peer->next) {
+        int peer_room = idle_only && inflight_load(&peer->inflight) > 0 ? 0 : peer_capacity(peer);
+        if (better_peer(peer, peer_room, best, best_room) && peer_may_have(peer, pkg->identifier, index) &&
+            can_serve(peer, chk, blk) &&
+            !(blk->assigned && inflight_has(peer, pkg->identifier, chk->hash, blk->offset, blk->len))) {
+            best = peer;
+            best_room = peer_room;
+        }
+    }
+    if (!best) {
+        return 0;
+    }
+
+    struct btide_req req = { .offset = blk->offset, .chunk_index = index };
+    snprintf(req.identifier, sizeof(req.identifier), "%s", pkg->identifier);
+    strcpy(req.chunk_hash, chk->hash);
+    if (inflight_submit(best, &req, blk->len) < 0) {
+        return 0;
+    }
+    // A duplicate leaves the block with the peer first asked
+    if (!blk->assigned) {
+        blk->assigned = best;
+        blk->assigned_ms = now;
+    }
+    return 1;
+}
+
+/*
+ * Hands missing, unassigned blocks to peers, rarest chunk first: chunks
+ * held by the fewest connected peers go out before common ones, ties
+ * broken at random so peers downloading together spread out. Each block
+ * goes to the least loaded peer that may have the chunk and still has
+ * room in its window, so the blocks of one large chunk are fetched from
+ * several peers at once.
+ *
+ * In end game, once DOWNLOAD_ENDGAME_BLOCKS or fewer are missing, blocks
+ * already requested are asked of up to DOWNLOAD_ENDGAME_PEERS peers so
+ * the last ones do not wait on the slowest peer. The first copy to arrive
+ * cancels the rest.
+ */
+static void schedule(struct download *dl, int rerank) {
+    struct package *pkg = dl->pkg;
+    uint64_t now = reactor_now_ms();
+    if (rerank) {
+        reclaim_stalled(dl, now);
+        rank_chunks(dl);
+        if (!dl->endgame && missing_blocks(dl) <= DOWNLOAD_ENDGAME_BLOCKS) {
+            dl->endgame = 1;
+            printf("Entering end game for %.32s\n", pkg->identifier);
+        }
+    }
+
+    int room = 0;
+    for (struct peer *peer = get_peer_list(); peer; peer = peer->next) {
+        room += peer_capacity(peer) > 0 ? peer_capacity(peer) : 0;
+    }
+
+    for (int c = 0; c < dl->norder && room > 0; c++) {
+        int index = dl->order[c];
+        if (package_has_chunk(pkg, index)) {
+            continue;
+        }
+        for (int b = dl->first_block[index]; b < dl->first_block[index + 1] && room > 0; b++) {
+            if (!dl->blocks[b].done) {
+                room -= schedule_block(dl, index, &dl->blocks[b], now);
+            }
+        }
+    }
+}
+
+int download_active() {
+    return download_list != NULL;
+}
+
+// Runs the scheduler for every download, finishing those with nothing left
+void download_schedule_all() {
+    struct download *dl = download_list;
+    while (dl) {
+        struct download *next = dl->next;
+        if (atomic_load(&dl->pkg->completed_chunks) == dl->pkg->nchunks) {
+            printf("Download of %.32s complete\n", dl->pkg->identifier);
+            unlink_download(dl);
+            free_download(dl);
+        } else {
+            schedule(dl, 1);
+        }
+        dl = next;
+    }
+}
+
+// The block of the chunk a request falls in, a retransmit starts part way into its block
+static struct download_block *find_block(struct download *dl, int index, uint32_t offset) {
+    int b = dl->first_block[index];
+    while (b + 1 < dl->first_block[index + 1] && dl->blocks[b + 1].offset <= offset) {
+        b++;
+    }
+    return &dl->blocks[b];
+}
+
+// Withdraws the end game duplicates of blocks first to last that have arrived
+static void cancel_duplicates(struct download *dl, int index, int first, int last) {
+    struct package *pkg = dl->pkg;
+    for (int b = first; b <= last; b++) {
+        struct download_block *blk = &dl->blocks[b];
+        for (struct peer *peer = get_peer_list(); peer; peer = peer->next) {
+            if (inflight_cancel(peer, pkg->identifier, pkg->chunks[index].hash, blk->offset, blk->len) &&
+                blk->assigned == peer) {
+                blk->assigned = NULL;
+            }
+        }
+    }
+}
+
+/*
+ * Blocks from several peers cannot tell which one sent bad data, so a
+ * chunk that fails its hash counts against every peer that delivered part
+ * of it, the caller handling the peer that completed it. All blocks are
+ * fetched again.
+ */
+static void reject_blocks(struct download *dl, struct peer *peer, int index) {
+    struct package *pkg = dl->pkg;
+    for (int b = dl->first_block[index]; b < dl->first_block[index + 1]; b++) {
+        struct download_block *blk = &dl->blocks[b];
+        if (blk->source && blk->source != peer) {
+            blk->source->req_failed++;
+            peer_mark_failed(blk->source, pkg->identifier, pkg->nchunks, index);
+        }
+        blk->done = 0;
+        blk->source = NULL;
+    }
+}
+
+// Verifies a chunk once every block has arrived
+static int commit_blocks(struct download *dl, struct peer *peer, int index) {
+    struct package *pkg = dl->pkg;
+    int first = dl->first_block[index];
+    int last = dl->first_block[index + 1] - 1;
+    for (int b = first; b <= last; b++) {
+        if (!dl->blocks[b].done) {
+            return INFLIGHT_DONE;
+        }
+    }
+    if (package_commit_chunk(pkg, index) == 0) {
+        serve_announce_chunk(pkg, index);
+        return INFLIGHT_DONE;
+    }
+
+    printf("Chunk %.16s from %s:%d failed verification\n", pkg->chunks[index].hash, peer->ip, peer->port);
+    reject_blocks(dl, peer, index);
+    return INFLIGHT_FAILED;
+}
+
+/*
+ * Called when the last bytes of a chunk, hashed as they streamed in, fail
+ * verification. The request that brought them fails as usual, the other
+ * blocks of the chunk are rejected as in commit_blocks.
+ */
+void download_on_corrupt(struct peer *peer, const char *identifier, int index) {
+    struct download *dl = find_download(identifier);
+    if (dl && index >= 0 && index < dl->pkg->nchunks) {
+        reject_blocks(dl, peer, index);
+    }
+}
+
+/*
+ * Forgets a peer that is going away. Blocks it delivered stay done, but
+ * no longer name it, so a later peer allocated at the same address is
+ * never blamed for them.
+ */
+void download_on_peer_removed(struct peer *peer) {
+    for (struct download *dl = download_list; dl; dl = dl->next) {
+        int nblocks = dl->first_block[dl->pkg->nchunks];
+        for (int b = 0; b < nblocks; b++) {
+            if (dl->blocks[b].assigned == peer) {
+                dl->blocks[b].assigned = NULL;
+            }
+            if (dl->blocks[b].source == peer) {
+                dl->blocks[b].source = NULL;
+            }
+        }
+    }
+}
+
+/*
+ * Records a block once its request completes, or frees it for another peer
+ * if the request failed, timed out or delivered corrupt data. The chunk is
+ * committed when its last block arrives.
+ */
+void download_on_request_done(struct peer *peer, struct btide_req *req, int status) {
+    struct package *pkg = find_package_exact(req->identifier);
+    int index = pkg ? package_find_chunk(pkg, req->chunk_hash) : -1;
+    if (index < 0) {
+        return;
+    }
+
+    // End game duplicates complete blocks assigned to another peer
+    struct download *dl = find_download(pkg->identifier);
+    struct download_block *blk = dl ? find_block(dl, index, req->offset) : NULL;
+    int scheduled = blk && (blk->assigned == peer || dl->endgame);
+    if (blk && blk->assigned == peer) {
+        blk->assigned = NULL;
+    }
+
+    // A FETCH for part of a chunk may not complete it, only requests from
+    // the scheduler count as corrupt when the hash is wrong
+    if (status == INFLIGHT_DONE && !package_has_chunk(pkg, index)) {
+        if (scheduled) {
+            blk->done = 1;
+            blk->source = peer;
+            status = commit_blocks(dl, peer, index);
+        } else if (package_commit_chunk(pkg, index) == 0) {
+            serve_announce_chunk(pkg, index);
+        }
+    }
+    if (status == INFLIGHT_DONE) {
+        peer->req_ok++;
+    } else if (status != INFLIGHT_CHOKED) {
+        peer->req_failed++;
+        // A slow answer says nothing of whether the peer has the chunk, it is asked again
+        if (status != INFLIGHT_TIMEOUT) {
+            peer_mark_failed(peer, pkg->identifier, pkg->nchunks, index);
+        }
+    }
+    if (dl && dl->endgame) {
+        if (package_has_chunk(pkg, index)) {
+            cancel_duplicates(dl, index, dl->first_block[index], dl->first_block[index + 1] - 1);
+        } else if (blk->done) {
+            cancel_duplicates(dl, index, blk - dl->blocks, blk - dl->blocks);
+        }
+    }
+
+    // Refill the freed slot right away rather than on the next tick
+    if (dl && !peer->closed) {
+        schedule(dl, 0);
+    }
+}
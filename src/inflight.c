@@ -0,0 +1,486 @@
+#include "../include/peer/inflight.h"
+#include "../include/peer/peer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define RATE_SAMPLE_MS (250)
+
+static inflight_done_fn done_handler = NULL;
+
+int inflight_init(struct inflight_table *table, int max_window) {
+    memset(table, 0, sizeof(struct inflight_table));
+    table->max_window = max_window > 0 ? max_window : 1;
+    table->window = INFLIGHT_WINDOW_INIT < table->max_window ? INFLIGHT_WINDOW_INIT : table->max_window;
+    table->ssthresh = table->max_window;
+    table->slots = malloc(table->max_window * sizeof(struct inflight_req));
+    return table->slots ? 0 : -1;
+}
+
+void inflight_destroy(struct inflight_table *table) {
+    free(table->slots);
+    free(table->queue);
+    free(table->queue_expected);
+    memset(table, 0, sizeof(struct inflight_table));
+}
+
+// Function to set who hears about finished or abandoned requests
+void inflight_set_done_handler(inflight_done_fn fn) {
+    done_handler = fn;
+}
+
+int inflight_window(struct inflight_table *table) {
+    int window = (int)table->window;
+    return window < 1 ? 1 : window;
+}
+
+// Retransmit timeout from the RTT estimate, RFC 6298 style
+static uint64_t rto_ms(struct inflight_table *table) {
+    if (table->srtt_ms == 0) {
+        return INFLIGHT_RTO_INIT_MS;
+    }
+    double rto = table->srtt_ms + 4 * table->rttvar_ms;
+    if (rto < INFLIGHT_RTO_MIN_MS) rto = INFLIGHT_RTO_MIN_MS;
+    if (rto > INFLIGHT_RTO_MAX_MS) rto = INFLIGHT_RTO_MAX_MS;
+    return (uint64_t)rto;
+}
+
+static int send_req(struct peer *peer, struct btide_req *req) {
+    struct btide_packet packet;
+    if (req_encode(&packet, req) < 0) {
+        return -1;
+    }
+    return peer_send(peer, &packet);
+}
+
+static int flush_batch(struct peer *peer, struct btide_batch *batch) {
+    if (batch->count == 0) {
+        return 0;
+    }
+    struct btide_packet packet;
+    packet_init(&packet, PKT_MSG_BRQ);
+    packet.len = batch_encode(batch, packet.pl.data);
+    batch->count = 0;
+    return peer_send(peer, &packet);
+}
+
+/*
+ * Sends a request. Peers that accept batches get consecutive requests for
+ * one package folded into a single BRQ, sent by flush_batch once the run
+ * ends, others get one text REQ each.
+ */
+static int send_batched(struct peer *peer, struct btide_batch *batch, struct inflight_req *slot) {
+    struct btide_req *req = &slot->req;
+    if (!(peer->features & PKT_FEAT_BATCH) || req->chunk_index < 0) {
+        if (flush_batch(peer, batch) < 0) {
+            return -1;
+        }
+        return send_req(peer, req);
+    }
+
+    if (batch->count == BRQ_RANGES_MAX ||
+        (batch->count > 0 && strcmp(batch->identifier, req->identifier) != 0)) {
+        if (flush_batch(peer, batch) < 0) {
+            return -1;
+        }
+    }
+    if (batch->count == 0) {
+        strcpy(batch->identifier, req->identifier);
+    }
+    struct btide_range *range = &batch->ranges[batch->count++];
+    range->index = req->chunk_index;
+    range->offset = req->offset;
+    range->len = slot->expected;
+    return 0;
+}
+
+// Moves queued requests into the window while there is room
+static void fill_window(struct peer *peer) {
+    struct inflight_table *table = &peer->inflight;
+    struct btide_batch batch = { .count = 0 };
+    while (table->qlen > 0 && table->count < inflight_window(table) && table->count < table->max_window) {
+        struct inflight_req *slot = &table->slots[table->count];
+        slot->req = table->queue[table->qhead];
+        slot->expected = table->queue_expected[table->qhead];
+        slot->received = 0;
+        slot->retries = 0;
+        slot->sent_ms = reactor_now_ms();
+        table->qhead = (table->qhead + 1) % table->qcap;
+        table->qlen--;
+
+        if (send_batched(peer, &batch, slot) < 0) {
+            // Off the queue and never sent, the requester must hear of it
+            struct btide_req req = slot->req;
+            flush_batch(peer, &batch);
+            if (done_handler) {
+                done_handler(peer, &req, INFLIGHT_FAILED);
+            }
+            return;
+        }
+        table->count++;
+    }
+    flush_batch(peer, &batch);
+}
+
+/*
+ * Queues a request for this peer, it is sent as soon as the window allows.
+ * Returns 1 if it went out immediately, 0 if it is waiting, -1 on error.
+ */
+int inflight_submit(struct peer *peer, const struct btide_req *req, uint32_t expected) {
+    struct inflight_table *table = &peer->inflight;
+    if (table->qlen == table->qcap) {
+        int cap = table->qcap ? table->qcap * 2 : 16;
+        struct btide_req *queue = malloc(cap * sizeof(struct btide_req));
+        uint32_t *queue_expected = malloc(cap * sizeof(uint32_t));
+        if (!queue || !queue_expected) {
+            free(queue);
+            free(queue_expected);
+            return -1;
+        }
+        for (int i = 0; i < table->qlen; i++) {
+            queue[i] = table->queue[(table->qhead + i) % table->qcap];
+            queue_expected[i] = table->queue_expected[(table->qhead + i) % table->qcap];
+        }
+        free(table->queue);
+        free(table->queue_expected);
+        table->queue = queue;
+        table->queue_expected = queue_expected;
+        table->qhead = 0;
+        table->qcap = cap;
+    }
+
+    int tail = (table->qhead + table->qlen) % table->qcap;
+    table->queue[tail] = *req;
+    table->queue_expected[tail] = expected;
+    table->qlen++;
+
+    int before = table->count;
+    fill_window(peer);
+    return table->count > before ? 1 : 0;
+}
+
+static void remove_slot(struct inflight_table *table, int index) {
+    table->slots[index] = table->slots[table->count - 1];
+    table->count--;
+}
+
+static void sample_rtt(struct inflight_table *table, double sample) {
+    if (table->srtt_ms == 0) {
+        table->srtt_ms = sample;
+        table->rttvar_ms = sample / 2;
+    } else {
+        table->rttvar_ms = 0.75 * table->rttvar_ms + 0.25 * fabs(table->srtt_ms - sample);
+        table->srtt_ms = 0.875 * table->srtt_ms + 0.125 * sample;
+    }
+}
+
+static void sample_rate(struct inflight_table *table, uint32_t bytes, uint64_t now) {
+    if (table->rate_start_ms == 0) {
+        table->rate_start_ms = now;
+    }
+    table->rate_bytes += bytes;
+    if (now - table->rate_start_ms >= RATE_SAMPLE_MS) {
+        double rate = (double)table->rate_bytes / (now - table->rate_start_ms);
+        table->rate = table->rate == 0 ? rate : 0.75 * table->rate + 0.25 * rate;
+        table->rate_bytes = 0;
+        table->rate_start_ms = now;
+    }
+}
+
+/*
+ * Grows the window after a completed request: by one per completion below
+ * ssthresh, by 1/window above it. The window never exceeds twice the
+ * requests needed to cover the bandwidth-delay product, so an idle or slow
+ * peer is not flooded with requests it cannot answer in time. The delay is
+ * the PING round trip when there is one, request RTTs grow with the
+ * queue the window itself builds at the peer.
+ */
+static void grow_window(struct inflight_table *table) {
+    if (table->window < table->ssthresh) {
+        table->window += 1;
+    } else {
+        table->window += 1 / table->window;
+    }
+
+    double delay = table->path_rtt_ms > 0 ? table->path_rtt_ms + table->path_jitter_ms : table->srtt_ms;
+    if (table->rate > 0 && delay > 0 && table->avg_req_bytes > 0) {
+        double bdp = table->rate * delay / table->avg_req_bytes;
+        double cap = 2 * bdp + INFLIGHT_WINDOW_INIT;
+        if (table->window > cap) {
+            table->window = cap;
+        }
+    }
+    if (table->window > table->max_window) {
+        table->window = table->max_window;
+    }
+}
+
+static void shrink_window(struct inflight_table *table) {
+    table->ssthresh = table->window / 2 > 1 ? table->window / 2 : 1;
+    table->window = table->ssthresh;
+}
+
+// Returns 1 if a RES carries the next bytes of an outstanding request
+int inflight_expects(struct peer *peer, struct btide_res *res) {
+    struct inflight_table *table = &peer->inflight;
+    for (int i = 0; i < table->count; i++) {
+        struct inflight_req *slot = &table->slots[i];
+        if (strcmp(slot->req.chunk_hash, res->chunk_hash) == 0 &&
+            strcmp(slot->req.identifier, res->identifier) == 0 &&
+            res->offset == slot->req.offset + slot->received) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// An error naming no chunk means the peer cannot serve the package at all
+static int fail_package(struct peer *peer, const char *identifier) {
+    struct inflight_table *table = &peer->inflight;
+    int found = 0;
+    for (int i = 0; i < table->count; i++) {
+        if (strcmp(table->slots[i].req.identifier, identifier) != 0) {
+            continue;
+        }
+        struct btide_req req = table->slots[i].req;
+        remove_slot(table, i--);
+        found = 1;
+        if (done_handler) {
+            done_handler(peer, &req, INFLIGHT_FAILED);
+        }
+    }
+    if (found) {
+        fill_window(peer);
+    }
+    return found;
+}
+
+/*
+ * Matches a RES to an outstanding request by identifier, hash and offset.
+ * Returns 1 if it belongs to one (the caller may keep the data), 0 if it
+ * was unsolicited or a duplicate.
+ */
+int inflight_on_response(struct peer *peer, struct btide_res *res, uint16_t error) {
+    struct inflight_table *table = &peer->inflight;
+    if (error && res->chunk_hash[0] == '\0') {
+        return fail_package(peer, res->identifier);
+    }
+    for (int i = 0; i < table->count; i++) {
+        struct inflight_req *slot = &table->slots[i];
+        if (strcmp(slot->req.chunk_hash, res->chunk_hash) != 0 ||
+            strcmp(slot->req.identifier, res->identifier) != 0) {
+            continue;
+        }
+
+        uint64_t now = reactor_now_ms();
+        if (error) {
+            struct btide_req req = slot->req;
+            remove_slot(table, i);
+            if (done_handler) {
+                done_handler(peer, &req, INFLIGHT_FAILED);
+            }
+            fill_window(peer);
+            return 1;
+        }
+
+        // Pieces arrive in order on one connection, anything else is a duplicate
+        if (res->offset != slot->req.offset + slot->received) {
+            continue;
+        }
+        if (slot->received == 0 && slot->retries == 0) {
+            // Karn's rule, retransmitted requests give ambiguous samples
+            sample_rtt(table, (double)(now - slot->sent_ms));
+        }
+        slot->received += res->data_len;
+        // A chunk still streaming in is not late, the timeout runs from its latest piece
+        slot->sent_ms = now;
+        sample_rate(table, res->data_len, now);
+
+        if (slot->received >= slot->expected) {
+            struct btide_req req = slot->req;
+            table->avg_req_bytes = table->avg_req_bytes == 0 ? slot->expected
+                                   : 0.875 * table->avg_req_bytes + 0.125 * slot->expected;
+            remove_slot(table, i);
+            grow_window(table);
+            if (done_handler) {
+                done_handler(peer, &req, INFLIGHT_DONE);
+            }
+            fill_window(peer);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Retransmits requests that outlived the RTO, giving up after INFLIGHT_MAX_RETRIES
+void inflight_check_timeouts(struct peer *peer, uint64_t now) {
+    struct inflight_table *table = &peer->inflight;
+    uint64_t rto = rto_ms(table);
+    int shrunk = 0;
+    struct btide_batch batch = { .count = 0 };
+
+    for (int i = 0; i < table->count && !peer->closed; i++) {
+        struct inflight_req *slot = &table->slots[i];
+        // Back off exponentially with each retransmit
+        if (now - slot->sent_ms < (rto << slot->retries)) {
+            continue;
+        }
+        if (!shrunk) {
+            shrink_window(table);
+            shrunk = 1;
+        }
+
+        if (slot->retries >= INFLIGHT_MAX_RETRIES) {
+            struct btide_req req = slot->req;
+            remove_slot(table, i--);
+            if (done_handler) {
+                done_handler(peer, &req, INFLIGHT_TIMEOUT);
+            }
+            continue;
+        }
+
+        // Ask again for whatever has not arrived
+        slot->req.offset += slot->received;
+        slot->expected -= slot->received;
+        slot->received = 0;
+        slot->retries++;
+        slot->sent_ms = now;
+        send_batched(peer, &batch, slot);
+    }
+    if (!peer->closed) {
+        flush_batch(peer, &batch);
+        fill_window(peer);
+    }
+}
+
+// Ends every outstanding and queued request with status
+static void end_all(struct peer *peer, int status) {
+    struct inflight_table *table = &peer->inflight;
+    while (table->count > 0) {
+        struct btide_req req = table->slots[table->count - 1].req;
+        table->count--;
+        if (done_handler) {
+            done_handler(peer, &req, status);
+        }
+    }
+    while (table->qlen > 0) {
+        struct btide_req req = table->queue[table->qhead];
+        table->qhead = (table->qhead + 1) % table->qcap;
+        table->qlen--;
+        if (done_handler) {
+            done_handler(peer, &req, status);
+        }
+    }
+}
+
+// Reports every outstanding and queued request as failed, used when the peer goes away
+void inflight_abort(struct peer *peer) {
+    end_all(peer, INFLIGHT_FAILED);
+}
+
+// Hands every request back unserved, used when the peer chokes us
+void inflight_release(struct peer *peer) {
+    end_all(peer, INFLIGHT_CHOKED);
+}
+
+/*
+ * Returns 1 if the request is for the chunk and starts within the len
+ * bytes at offset. A retransmit starts where the data stopped, so it
+ * still falls within the range first asked for.
+ */
+static int covers(const struct btide_req *req, const char *identifier, const char *hash, uint32_t offset,
+                  uint32_t len) {
+    return strcmp(req->chunk_hash, hash) == 0 && strcmp(req->identifier, identifier) == 0 &&
+           req->offset >= offset && (req->offset - offset < len || req->offset == offset);
+}
+
+// Drops a request that is still waiting for window space, returns 1 if found
+int inflight_cancel_queued(struct peer *peer, const char *identifier, const char *hash, uint32_t offset, uint32_t len) {
+    struct inflight_table *table = &peer->inflight;
+    for (int i = 0; i < table->qlen; i++) {
+        int at = (table->qhead + i) % table->qcap;
+        if (!covers(&table->queue[at], identifier, hash, offset, len)) {
+            continue;
+        }
+        // Close the gap, keeping the queue order
+        for (int j = i; j < table->qlen - 1; j++) {
+            int from = (table->qhead + j + 1) % table->qcap;
+            int to = (table->qhead + j) % table->qcap;
+            table->queue[to] = table->queue[from];
+            table->queue_expected[to] = table->queue_expected[from];
+        }
+        table->qlen--;
+        return 1;
+    }
+    return 0;
+}
+
+// Returns 1 if a request within the range is outstanding or waiting for this peer
+int inflight_has(struct peer *peer, const char *identifier, const char *hash, uint32_t offset, uint32_t len) {
+    struct inflight_table *table = &peer->inflight;
+    for (int i = 0; i < table->count; i++) {
+        if (covers(&table->slots[i].req, identifier, hash, offset, len)) {
+            return 1;
+        }
+    }
+    for (int i = 0; i < table->qlen; i++) {
+        if (covers(&table->queue[(table->qhead + i) % table->qcap], identifier, hash, offset, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Withdraws a request within the range wherever it is, returns 1 if found.
+ * One already sent is forgotten, so data still on its way is ignored, and
+ * a peer that understands CAN is told to drop whatever of it has not been
+ * queued yet.
+ */
+int inflight_cancel(struct peer *peer, const char *identifier, const char *hash, uint32_t offset, uint32_t len) {
+    if (inflight_cancel_queued(peer, identifier, hash, offset, len)) {
+        return 1;
+    }
+    struct inflight_table *table = &peer->inflight;
+    for (int i = 0; i < table->count; i++) {
+        struct btide_req *req = &table->slots[i].req;
+        if (!covers(req, identifier, hash, offset, len)) {
+            continue;
+        }
+        if ((peer->features & PKT_FEAT_CANCEL) && req->chunk_index >= 0) {
+            struct btide_batch batch = { .count = 1 };
+            strcpy(batch.identifier, req->identifier);
+            batch.ranges[0].index = req->chunk_index;
+            batch.ranges[0].offset = req->offset;
+            batch.ranges[0].len = table->slots[i].expected;
+
+            struct btide_packet packet;
+            packet_init(&packet, PKT_MSG_CAN);
+            packet.len = batch_encode(&batch, packet.pl.data);
+            peer_send(peer, &packet);
+        }
+        remove_slot(table, i);
+        fill_window(peer);
+        return 1;
+    }
+    return 0;
+}
+
+// Requests outstanding or waiting for this peer
+int inflight_load(struct inflight_table *table) {
+    return table->count + table->qlen;
+}
+
+// Records the peer's PING round trip for window sizing
+void inflight_set_path_rtt(struct inflight_table *table, double rtt_ms, double jitter_ms) {
+    table->path_rtt_ms = rtt_ms;
+    table->path_jitter_ms = jitter_ms;
+}
+
+// Pushes every deadline back, for time we held the peer's answers back ourselves
+void inflight_postpone(struct inflight_table *table, uint64_t ms) {
+    for (int i = 0; i < table->count; i++) {
+        table->slots[i].sent_ms += ms;
+    }
+}
@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+#include "../include/pkg/journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+ * The journal is a text file of one record per line, each line ending in
+ * " #<fnv1a>" over the record text so torn or corrupt lines are skipped:
+ *
+ *   A <ident> <pkgfile> <datafile>               package admitted
+ *   R <ident>                                    package removed
+ *   S <ident> <size> <sec> <nsec> <n> <bitmap>   completion snapshot
+ *   C <ident> <index> <size> <sec> <nsec>        chunk verified
+ *
+ * Size and mtime are those of the data file right after the event, so a
+ * data file modified behind our back is detected and re-verified.
+ */
+
+struct journal_entry {
+    char ident[1025];
+    char pkgfile[256];
+    char datafile[256];
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    uint32_t nchunks;
+    uint8_t *status;    // Packed completion bitmap, NULL until a snapshot is seen
+    int removed;
+    struct journal_entry *next;
+};
+
+static int journal_fd = -1;
+static char journal_path[512];
+static char journal_dir[256];
+static size_t record_count = 0;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t fnv1a(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void stat_data_file(const char *path, long long *size, long long *sec, long *nsec) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        *size = st.st_size;
+        *sec = st.st_mtim.tv_sec;
+        *nsec = st.st_mtim.tv_nsec;
+    } else {
+        *size = -1;
+        *sec = 0;
+        *nsec = 0;
+    }
+}
+
+// Writes one record with its checksum, the caller holds journal_lock
+static int write_record(int fd, const char *record) {
+    size_t len = strlen(record);
+    char tail[16];
+    int tlen = snprintf(tail, sizeof(tail), " #%08x\n", fnv1a(record, len));
+
+    char *line = malloc(len + tlen);
+    if (!line) {
+        return -1;
+    }
+    memcpy(line, record, len);
+    memcpy(line + len, tail, tlen);
+
+    // A single write keeps the line whole with O_APPEND
+    size_t off = 0;
+    while (off < len + tlen) {
+        ssize_t n = write(fd, line + off, len + tlen - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("journal write");
+            free(line);
+            return -1;
+        }
+        off += n;
+    }
+    free(line);
+    return 0;
+}
+
+static int write_added(int fd, struct package *pkg) {
+    char record[1600];
+    snprintf(record, sizeof(record), "A %s %s %s", pkg->identifier, pkg->pkgfile, pkg->filename);
+    return write_record(fd, record);
+}
+
+// Remembers the data file size and mtime the current bitmap was checked against
+static void note_data_file(struct package *pkg) {
+    long long sec;
+    long nsec;
+    stat_data_file(pkg->datapath, &pkg->data_size, &sec, &nsec);
+    pkg->data_mtime.tv_sec = sec;
+    pkg->data_mtime.tv_nsec = nsec;
+}
+
+static int write_snapshot(int fd, struct package *pkg) {
+    size_t nbytes = bitmap_bytes(pkg->have.nbits);
+    uint8_t *packed = malloc(nbytes ? nbytes : 1);
+    char *record = malloc(1200 + 2 * nbytes);
+    if (!packed || !record) {
+        free(packed);
+        free(record);
+        return -1;
+    }
+    bitmap_export(&pkg->have, packed);
+
+    int len = sprintf(record, "S %s %lld %lld %ld %u ", pkg->identifier, pkg->data_size,
+                      (long long)pkg->data_mtime.tv_sec, pkg->data_mtime.tv_nsec, pkg->have.nbits);
+    for (size_t i = 0; i < nbytes; i++) {
+        len += sprintf(record + len, "%02x", packed[i]);
+    }
+    if (nbytes == 0) {
+        strcpy(record + len, "-");
+    }
+
+    int rc = write_record(fd, record);
+    free(packed);
+    free(record);
+    return rc;
+}
+
+// Appends a record to the live journal and compacts once it grows too long
+static void append_locked(const char *record, int sync) {
+    if (journal_fd < 0) {
+        return;
+    }
+    if (write_record(journal_fd, record) == 0) {
+        record_count++;
+        if (sync) {
+            fdatasync(journal_fd);
+        }
+    }
+}
+
+static void maybe_compact() {
+    pthread_mutex_lock(&journal_lock);
+    int needed = journal_fd >= 0 && record_count > JOURNAL_COMPACT_RECORDS;
+    pthread_mutex_unlock(&journal_lock);
+    if (needed) {
+        journal_compact();
+    }
+}
+
+// Records a newly admitted package along with its verified chunks
+void journal_package_added(struct package *pkg) {
+    note_data_file(pkg);
+    pthread_mutex_lock(&journal_lock);
+    if (journal_fd >= 0) {
+        if (write_added(journal_fd, pkg) == 0 && write_snapshot(journal_fd, pkg) == 0) {
+            record_count += 2;
+        }
+        fdatasync(journal_fd);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    maybe_compact();
+}
+
+void journal_package_removed(const char *identifier) {
+    char record[1100];
+    snprintf(record, sizeof(record), "R %s", identifier);
+    pthread_mutex_lock(&journal_lock);
+    append_locked(record, 1);
+    pthread_mutex_unlock(&journal_lock);
+    maybe_compact();
+}
+
+// Chunk events are not synced, a lost record only costs a re-verification
+void journal_chunk_verified(struct package *pkg, int index) {
+    note_data_file(pkg);
+
+    char record[1200];
+    snprintf(record, sizeof(record), "C %s %d %lld %lld %ld", pkg->identifier, index, pkg->data_size,
+             (long long)pkg->data_mtime.tv_sec, pkg->data_mtime.tv_nsec);
+    pthread_mutex_lock(&journal_lock);
+    append_locked(record, 0);
+    pthread_mutex_unlock(&journal_lock);
+    maybe_compact();
+}
+
+// Rewrites the journal as one admission and snapshot per managed package
+int journal_compact() {
+    char tmp_path[520];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal_path);
+
+    pthread_mutex_lock(&journal_lock);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror("Failed to create journal");
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+
+    size_t count = 0;
+    for (struct package *pkg = get_package_list(); pkg; pkg = pkg->next) {
+        if (write_added(fd, pkg) != 0 || write_snapshot(fd, pkg) != 0) {
+            close(fd);
+            unlink(tmp_path);
+            pthread_mutex_unlock(&journal_lock);
+            return -1;
+        }
+        count += 2;
+    }
+
+    // Make the new journal durable before it replaces the old one
+    if (fsync(fd) != 0 || rename(tmp_path, journal_path) != 0) {
+        perror("Failed to replace journal");
+        close(fd);
+        unlink(tmp_path);
+        pthread_mutex_unlock(&journal_lock);
+        return -1;
+    }
+    close(fd);
+
+    int dir_fd = open(journal_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    if (journal_fd >= 0) {
+        close(journal_fd);
+    }
+    journal_fd = open(journal_path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (journal_fd < 0) {
+        perror("Failed to open journal");
+    }
+    record_count = count;
+    pthread_mutex_unlock(&journal_lock);
+    return journal_fd >= 0 ? 0 : -1;
+}
+
+static struct journal_entry *find_entry(struct journal_entry *list, const char *ident) {
+    while (list && strcmp(list->ident, ident) != 0) {
+        list = list->next;
+    }
+    return list;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Applies a single verified record to the replay state
+static void replay_record(struct journal_entry **list, char *record) {
+    char *save = NULL;
+    char *type = strtok_r(record, " ", &save);
+    char *ident = strtok_r(NULL, " ", &save);
+    if (!type || !ident || strlen(ident) > 1024) {
+        return;
+    }
+
+    struct journal_entry *entry = find_entry(*list, ident);
+    if (strcmp(type, "A") == 0) {
+        char *pkgfile = strtok_r(NULL, " ", &save);
+        char *datafile = strtok_r(NULL, " ", &save);
+        if (!pkgfile || !datafile) {
+            return;
+        }
+        if (!entry) {
+            entry = calloc(1, sizeof(struct journal_entry));
+            if (!entry) {
+                return;
+            }
+            strcpy(entry->ident, ident);
+            entry->next = *list;
+            *list = entry;
+        }
+        snprintf(entry->pkgfile, sizeof(entry->pkgfile), "%s", pkgfile);
+        snprintf(entry->datafile, sizeof(entry->datafile), "%s", datafile);
+        free(entry->status);
+        entry->status = NULL;
+        entry->removed = 0;
+        return;
+    }
+    if (!entry) {
+        return;
+    }
+
+    if (strcmp(type, "R") == 0) {
+        entry->removed = 1;
+    } else if (strcmp(type, "S") == 0) {
+        char *size = strtok_r(NULL, " ", &save);
+        char *sec = strtok_r(NULL, " ", &save);
+        char *nsec = strtok_r(NULL, " ", &save);
+        char *nchunks = strtok_r(NULL, " ", &save);
+        char *hex = strtok_r(NULL, " ", &save);
+        if (!size || !sec || !nsec || !nchunks || !hex) {
+            return;
+        }
+
+        uint32_t n = strtoul(nchunks, NULL, 10);
+        size_t nbytes = bitmap_bytes(n);
+        if (strcmp(hex, "-") != 0 && strlen(hex) != 2 * nbytes) {
+            return;
+        }
+        uint8_t *status = calloc(nbytes ? nbytes : 1, 1);
+        if (!status) {
+            return;
+        }
+        for (size_t i = 0; i < nbytes; i++) {
+            int hi = hex_value(hex[2 * i]), lo = hex_value(hex[2 * i + 1]);
+            if (hi < 0 || lo < 0) {
+                free(status);
+                return;
+            }
+            status[i] = (uint8_t)(hi << 4 | lo);
+        }
+
+        free(entry->status);
+        entry->status = status;
+        entry->nchunks = n;
+        entry->size = strtoll(size, NULL, 10);
+        entry->mtime_sec = strtoll(sec, NULL, 10);
+        entry->mtime_nsec = strtol(nsec, NULL, 10);
+    } else if (strcmp(type, "C") == 0) {
+        char *index = strtok_r(NULL, " ", &save);
+        char *size = strtok_r(NULL, " ", &save);
+        char *sec = strtok_r(NULL, " ", &save);
+        char *nsec = strtok_r(NULL, " ", &save);
+        if (!index || !size || !sec || !nsec || !entry->status) {
+            return;
+        }
+
+        uint32_t i = strtoul(index, NULL, 10);
+        if (i < entry->nchunks) {
+            entry->status[i / 8] |= (uint8_t)(1u << (i % 8));
+        }
+        entry->size = strtoll(size, NULL, 10);
+        entry->mtime_sec = strtoll(sec, NULL, 10);
+        entry->mtime_nsec = strtol(nsec, NULL, 10);
+    }
+}
+
+// Replays the journal in directory, restoring managed packages, then compacts it
+int journal_open(const char *directory) {
+    snprintf(journal_dir, sizeof(journal_dir), "%s", directory);
+    snprintf(journal_path, sizeof(journal_path), "%s/%s", directory, JOURNAL_FILE);
+
+    struct journal_entry *entries = NULL;
+    FILE *file = fopen(journal_path, "r");
+    if (file) {
+        char *line = NULL;
+        size_t cap = 0;
+        ssize_t len;
+        while ((len = getline(&line, &cap, file)) > 0) {
+            // Skip torn writes and lines whose checksum does not match
+            if (line[len - 1] != '\n' || len < 11 || line[len - 11] != ' ' || line[len - 10] != '#') {
+                continue;
+            }
+            line[len - 1] = '\0';
+            uint32_t sum = strtoul(line + len - 9, NULL, 16);
+            if (fnv1a(line, len - 11) != sum) {
+                continue;
+            }
+            line[len - 11] = '\0';
+            replay_record(&entries, line);
+        }
+        free(line);
+        fclose(file);
+    }
+
+    // Restore in admission order, entries were collected newest first
+    struct journal_entry *ordered = NULL;
+    while (entries) {
+        struct journal_entry *next = entries->next;
+        entries->next = ordered;
+        ordered = entries;
+        entries = next;
+    }
+
+    int restored = 0;
+    while (ordered) {
+        struct journal_entry *entry = ordered;
+        ordered = entry->next;
+
+        if (!entry->removed) {
+            char data_path[512];
+            long long size, sec;
+            long nsec;
+            snprintf(data_path, sizeof(data_path), "%s/%s", directory, entry->datafile);
+            stat_data_file(data_path, &size, &sec, &nsec);
+
+            // Only trust the recorded bitmap if the data file is untouched
+            int unchanged = entry->status && size >= 0 && size == entry->size &&
+                            sec == entry->mtime_sec && nsec == entry->mtime_nsec;
+            if (!unchanged) {
+                printf("Data file %s changed, re-verifying.\n", entry->datafile);
+            }
+            if (load_package_with_status(entry->pkgfile, unchanged ? entry->status : NULL,
+                                         (int)entry->nchunks)) {
+                restored++;
+            }
+        }
+        free(entry->status);
+        free(entry);
+    }
+
+    if (restored > 0) {
+        printf("Restored %d package(s) from journal.\n", restored);
+    }
+    return journal_compact();
+}
@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include "../include/peer/local.h"
+#include "../include/peer/dial.h"
+#include "../include/config/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Peers on the same host reached through a Unix domain socket. They speak
+ * the same protocol as TCP peers, but since both ends share a filesystem
+ * a request is answered with an RFD, a descriptor of the data file the
+ * receiver reads from, rather than with the chunk bytes themselves. Local
+ * peers have no address, each is listed as unix:N in connection order.
+ */
+extern Config config;
+static struct reactor_handler local_handler;
+static char local_path[LOCAL_SOCKET_MAX];
+static int local_count = 0;
+
+static int fill_addr(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static struct peer *register_local(int sockfd) {
+    return peer_register(sockfd, LOCAL_PEER_IP, ++local_count);
+}
+
+// Accepts every pending local connection
+static void on_local_event(void *ctx, uint32_t events) {
+    while (1) {
+        int sockfd = accept4(local_handler.fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sockfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Accept failed");
+            }
+            if (errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+        if (peer_count() >= config.max_peers) {
+            printf("Peer limit of %d reached.\n", config.max_peers);
+            peer_reject(sockfd);
+        } else if (register_local(sockfd)) {
+            printf("Accepted local connection from peer.\n");
+        }
+    }
+}
+
+static void unlink_path() {
+    unlink(local_path);
+}
+
+/*
+ * Listens on a Unix domain socket besides the TCP port. A socket file
+ * left behind by an earlier run is replaced, and removed again on exit.
+ */
+int local_listen(const char *path) {
+    struct sockaddr_un addr;
+    if (fill_addr(&addr, path) < 0) {
+        perror("Local socket");
+        return -1;
+    }
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        perror("Local socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sockfd, config.max_peers) < 0) {
+        perror("Local bind failed");
+        close(sockfd);
+        return -1;
+    }
+    snprintf(local_path, sizeof(local_path), "%s", path);
+    atexit(unlink_path);
+
+    local_handler.fd = sockfd;
+    local_handler.fn = on_local_event;
+    if (reactor_add(&local_handler, EPOLLIN | EPOLLET) < 0) {
+        perror("epoll_ctl");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Connects to a peer listening on path, a local connect completes or fails at once
+int local_connect(const char *path) {
+    if (peer_count() + dial_pending() >= config.max_peers) {
+        printf("Peer limit of %d reached.\n", config.max_peers);
+        return -1;
+    }
+    struct sockaddr_un addr;
+    if (fill_addr(&addr, path) < 0) {
+        printf("Connection to %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        perror("Local socket");
+        return -1;
+    }
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        printf("Connection to %s failed: %s\n", path, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    if (!register_local(sockfd)) {
+        return -1;
+    }
+    printf("Connection established with peer\n");
+    return 0;
+}
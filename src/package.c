@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
 #include "../include/pkg/package.h"
+#include "../include/pkg/journal.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 static struct package *package_list = NULL;
 extern Config config;
@@ -30,10 +33,22 @@ void remove_package(const char *identifier) {
     if (*current) {
         struct package *to_free = *current;
         *current = (*current)->next;
+        journal_package_removed(to_free->identifier);
         for (int i = 0; i < to_free->nchunks; i++) {
             free(to_free->chunks[i].data);
         }
         free(to_free->chunks);
+        for (int i = 0; i < to_free->nchunks; i++) {
+            free(to_free->rx[i]);
+        }
+        free(to_free->rx);
+        if (to_free->data_fd >= 0) {
+            close(to_free->data_fd);
+        }
+        if (to_free->read_fd >= 0) {
+            close(to_free->read_fd);
+        }
+        bitmap_destroy(&to_free->have);
         free(to_free);
     }
 }
@@ -43,7 +58,7 @@ struct package *get_package_list() {
     return package_list;
 }
 
-// Function to find a package by identifier
+// Function to find a package by identifier, a prefix typed at the CLI is enough
 struct package *find_package(const char *identifier) {
     struct package *current = package_list;
     while (current && strncmp(current->identifier, identifier, strlen(identifier)) != 0) {        
@@ -52,8 +67,22 @@ struct package *find_package(const char *identifier) {
     return current;
 }
 
-// Function to load a package from a file
+// Finds a package by its full identifier, for identifiers that come off the wire
+struct package *find_package_exact(const char *identifier) {
+    struct package *current = package_list;
+    while (current && strcmp(current->identifier, identifier) != 0) {
+        current = current->next;
+    }
+    return current;
+}
+
+// Function to load a package from a file, verifying every chunk
 int load_package(const char *pkg_filename) {
+    return load_package_with_status(pkg_filename, NULL, 0);
+}
+
+// Loads a package, trusting the packed completion bitmap when one is given
+int load_package_with_status(const char *pkg_filename, const uint8_t *known, int known_nchunks) {
     if (!pkg_filename || strlen(pkg_filename) == 0) {
         printf("Missing file argument.\n");
         return 0;
@@ -61,7 +90,7 @@ int load_package(const char *pkg_filename) {
 
     // Create the full path to the .bpkg file using the directory from the config
     char full_pkg_path[512];
-    snprintf(full_pkg_path, sizeof(full_pkg_path) + 1, "%s/%s", config.directory, pkg_filename);
+    snprintf(full_pkg_path, sizeof(full_pkg_path), "%s/%s", config.directory, pkg_filename);
 
     // Load the .bpkg file
     struct bpkg_obj *pkg = bpkg_load(full_pkg_path);
@@ -70,6 +99,12 @@ int load_package(const char *pkg_filename) {
         return 0;
     }
 
+    if (find_package_exact(pkg->ident)) {
+        printf("Package is already managed.\n");
+        bpkg_obj_destroy(pkg);
+        return 0;
+    }
+
     struct chunk *chunks = malloc(pkg->nchunks * sizeof(struct chunk));
     if (!chunks) {
         fprintf(stderr, "Failed to allocate memory for chunks\n");
@@ -94,28 +129,72 @@ int load_package(const char *pkg_filename) {
         memset(chunks[i].data, 0, chunks[i].size); // Initialize the data buffer
     }
 
-    // Create the full path to the binary file using the directory from the config
-    char full_data_path[512];
-    snprintf(full_data_path, sizeof(full_data_path) + 1, "%s/%s", config.directory, pkg->filename);
-
-    // Use bpkg_get_completed_chunks to check if the package is complete
-    struct bpkg_query completed_chunks = bpkg_get_completed_chunks(pkg);
-    int is_complete = (completed_chunks.len == pkg->nchunks);
+    // Verify each chunk against its leaf hash so a partial download resumes,
+    // unless the journal already vouches for the data file
+    uint8_t *status = calloc(pkg->nchunks ? pkg->nchunks : 1, sizeof(uint8_t));
+    if (!status) {
+        fprintf(stderr, "Failed to allocate memory for chunk status\n");
+        for (int i = 0; i < pkg->nchunks; i++) {
+            free(chunks[i].data);
+        }
+        free(chunks);
+        bpkg_obj_destroy(pkg);
+        return 0;
+    }
+    if (known && known_nchunks != pkg->nchunks) {
+        // The bitmap was taken against a different .bpkg, it says nothing about this one
+        printf("Package %s changed, re-verifying.\n", pkg_filename);
+        known = NULL;
+    }
+    if (known) {
+        for (int i = 0; i < pkg->nchunks; i++) {
+            status[i] = (known[i / 8] >> (i % 8)) & 1;
+        }
+    } else {
+        bpkg_get_chunk_status(pkg, status);
+    }
 
     // Create and add the new package to the list
     struct package *new_package = (struct package *)malloc(sizeof(struct package));
+    struct chunk_rx **rx = calloc(pkg->nchunks ? pkg->nchunks : 1, sizeof(struct chunk_rx *));
+    if (!new_package || !rx || bitmap_init(&new_package->have, pkg->nchunks) != 0) {
+        fprintf(stderr, "Failed to allocate memory for package\n");
+        free(new_package);
+        free(rx);
+        free(status);
+        for (int i = 0; i < pkg->nchunks; i++) {
+            free(chunks[i].data);
+        }
+        free(chunks);
+        bpkg_obj_destroy(pkg);
+        return 0;
+    }
     strncpy(new_package->identifier, pkg->ident, 1024);
     strncpy(new_package->filename, pkg->filename, 256);
+    snprintf(new_package->pkgfile, sizeof(new_package->pkgfile), "%s", pkg_filename);
+    // Create the full path to the binary file using the directory from the config
+    snprintf(new_package->datapath, sizeof(new_package->datapath), "%s/%s", config.directory, pkg->filename);
     new_package->size = pkg->size;
     new_package->nchunks = pkg->nchunks;
-    new_package->completed_chunks = is_complete ? new_package->nchunks : 0;
+    atomic_init(&new_package->completed_chunks, 0);
+    new_package->prefix_chunks = 0;
     new_package->chunks = chunks;
+    new_package->rx = rx;
+    new_package->data_fd = -1;
+    new_package->read_fd = -1;
     new_package->next = NULL;
 
+    for (int i = 0; i < pkg->nchunks; i++) {
+        if (status[i]) {
+            package_mark_chunk(new_package, i);
+        }
+    }
+    free(status);
+
     add_package(new_package);
+    journal_package_added(new_package);
 
     bpkg_obj_destroy(pkg);
-    bpkg_query_destroy(&completed_chunks);
 
     return 1;
 }
@@ -127,10 +206,193 @@ void print_packages() {
     } else {
         int count = 1;
         while (current) {
-            printf("%d. %.32s, %s/%s : %s\n", count, current->identifier, config.directory, current->filename,
-                   (current->completed_chunks == current->nchunks) ? "COMPLETED" : "INCOMPLETE");
+            int done = atomic_load(&current->completed_chunks);
+            if (done == current->nchunks) {
+                printf("%d. %.32s, %s/%s : COMPLETED\n", count, current->identifier, config.directory,
+                       current->filename);
+            } else {
+                printf("%d. %.32s, %s/%s : INCOMPLETE (%.1f%%)\n", count, current->identifier, config.directory,
+                       current->filename, current->nchunks ? 100.0 * done / current->nchunks : 0.0);
+            }
             current = current->next;
             count++;
         }
     }
 }
+
+// Returns 1 if the chunk at index has been verified
+int package_has_chunk(struct package *pkg, int index) {
+    if (index < 0 || index >= pkg->nchunks) {
+        return 0;
+    }
+    return bitmap_test(&pkg->have, index);
+}
+
+// Marks a chunk verified, returns 1 if it was not already complete
+int package_mark_chunk(struct package *pkg, int index) {
+    if (index < 0 || index >= pkg->nchunks) {
+        return 0;
+    }
+    if (!bitmap_set(&pkg->have, index)) {
+        return 0;
+    }
+    atomic_fetch_add(&pkg->completed_chunks, 1);
+    while (pkg->prefix_chunks < pkg->nchunks && bitmap_test(&pkg->have, pkg->prefix_chunks)) {
+        pkg->prefix_chunks++;
+    }
+    return 1;
+}
+
+/*
+ * Bytes from the start of the data file that are verified and written.
+ * Chunks are listed in file order, so a reader may consume the file up to
+ * here while the rest is still downloading.
+ */
+long long package_readable(struct package *pkg) {
+    if (pkg->prefix_chunks == pkg->nchunks) {
+        return pkg->size;
+    }
+    return pkg->chunks[pkg->prefix_chunks].offset;
+}
+
+// Returns the index of the chunk with the given hash, or -1
+int package_find_chunk(struct package *pkg, const char *hash) {
+    for (int i = 0; i < pkg->nchunks; i++) {
+        if (strcmp(pkg->chunks[i].hash, hash) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Opens the data file once, creating it for downloads, read-only if it cannot be written
+int package_data_fd(struct package *pkg) {
+    if (pkg->data_fd < 0) {
+        pkg->data_fd = open(pkg->datapath, O_RDWR | O_CREAT, 0644);
+        if (pkg->data_fd < 0) {
+            pkg->data_fd = open(pkg->datapath, O_RDONLY);
+        }
+        if (pkg->data_fd < 0) {
+            perror("Failed to open data file");
+        }
+    }
+    return pkg->data_fd;
+}
+
+// Opens the data file read-only once, the descriptor handed to local peers must not let them write
+int package_read_fd(struct package *pkg) {
+    if (pkg->read_fd < 0) {
+        pkg->read_fd = open(pkg->datapath, O_RDONLY | O_CLOEXEC);
+        if (pkg->read_fd < 0) {
+            perror("Failed to open data file");
+        }
+    }
+    return pkg->read_fd;
+}
+
+// Writes a verified chunk to the data file and marks it complete
+static int write_chunk(struct package *pkg, int index) {
+    struct chunk *chk = &pkg->chunks[index];
+    free(pkg->rx[index]);
+    pkg->rx[index] = NULL;
+
+    int fd = package_data_fd(pkg);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t written = 0;
+    while (written < chk->size) {
+        ssize_t n = pwrite(fd, chk->data + written, chk->size - written, (off_t)chk->offset + written);
+        if (n < 0) {
+            perror("Failed to write chunk");
+            return -1;
+        }
+        written += n;
+    }
+
+    if (package_mark_chunk(pkg, index)) {
+        journal_chunk_verified(pkg, index);
+    }
+    return 0;
+}
+
+/*
+ * Verifies the chunk buffer against the chunk hash and, if it matches,
+ * writes it to the data file and marks the chunk complete. Returns 0 on
+ * success, -1 if the data is corrupt or could not be written. Used when
+ * the bytes did not arrive in order for package_store to hash them.
+ */
+int package_commit_chunk(struct package *pkg, int index) {
+    if (index < 0 || index >= pkg->nchunks) {
+        return -1;
+    }
+    struct chunk *chk = &pkg->chunks[index];
+
+    char *hex = compute_sha256_hex((uint8_t *)chk->data, chk->size);
+    int valid = hex && strcmp(hex, chk->hash) == 0;
+    free(hex);
+    if (!valid) {
+        return -1;
+    }
+    return write_chunk(pkg, index);
+}
+
+/*
+ * Copies received bytes into the chunk buffer and feeds them to the
+ * chunk's running digest. A chunk whose bytes all arrived in order is
+ * verified and written the moment the last one lands, without hashing
+ * the buffer again. Bytes that arrive out of order leave verification to
+ * package_commit_chunk. A piece at offset 0 always starts a new digest,
+ * as when a request is retried from another peer. Bytes for a chunk
+ * already verified are dropped.
+ */
+int package_store(struct package *pkg, int index, uint32_t offset, const uint8_t *data, size_t len) {
+    if (index < 0 || index >= pkg->nchunks) {
+        return -1;
+    }
+    struct chunk *chk = &pkg->chunks[index];
+    if (offset > chk->size || len > chk->size - offset) {
+        fprintf(stderr, "Data length exceeds chunk size\n");
+        return -1;
+    }
+    // A late or duplicate copy must not overwrite bytes already verified
+    if (package_has_chunk(pkg, index)) {
+        return PACKAGE_STORE_PARTIAL;
+    }
+    memcpy(chk->data + offset, data, len);
+
+    struct chunk_rx *rx = pkg->rx[index];
+    if (offset == 0) {
+        if (!rx && !(rx = pkg->rx[index] = malloc(sizeof(struct chunk_rx)))) {
+            return PACKAGE_STORE_PARTIAL;
+        }
+        sha256_compute_data_init(&rx->sha);
+        rx->hashed = 0;
+        rx->broken = 0;
+    }
+    if (!rx || rx->broken) {
+        return PACKAGE_STORE_PARTIAL;
+    }
+    if (offset != rx->hashed) {
+        rx->broken = 1;
+        return PACKAGE_STORE_PARTIAL;
+    }
+
+    sha256_update(&rx->sha, (void *)data, len);
+    rx->hashed += len;
+    if (rx->hashed < chk->size) {
+        return PACKAGE_STORE_PARTIAL;
+    }
+
+    char hex[SHA256_CHUNK_SZ + 1];
+    uint8_t digest[SHA256_CHUNK_SZ];
+    sha256_finalize(&rx->sha, digest);
+    sha256_output_hex(&rx->sha, hex);
+    hex[SHA256_CHUNK_SZ] = '\0';
+    if (strcmp(hex, chk->hash) != 0) {
+        free(rx);
+        pkg->rx[index] = NULL;
+        return PACKAGE_STORE_CORRUPT;
+    }
+    return write_chunk(pkg, index) == 0 ? PACKAGE_STORE_COMMITTED : -1;
+}
@@ -1,57 +1,748 @@
 #include "../include/net/packet.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 
-#define PACKET_SIZE 4096
+// Resets the header fields, the payload is left to the caller
+void packet_init(struct btide_packet *packet, uint16_t msg_code) {
+    packet->msg_code = msg_code;
+    packet->error = 0;
+    packet->len = 0;
+    packet->body = NULL;
+    packet->body_owned = 0;
+}
+
+uint8_t *packet_payload(struct btide_packet *packet) {
+    return packet->body ? packet->body : packet->pl.data;
+}
+
+// Frees a payload allocated while receiving
+void packet_release(struct btide_packet *packet) {
+    if (packet->body_owned) {
+        free(packet->body);
+    }
+    packet->body = NULL;
+    packet->body_owned = 0;
+}
+
+// Sends every byte of the iovec array, resuming after partial writes
+static int send_all(int socket, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t sent = writev(socket, iov, iovcnt);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+// Receives exactly len bytes
+static int recv_all(int socket, uint8_t *buffer, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(socket, buffer + got, len - got, 0);
+        if (n == 0) {
+            printf("Peer has closed the connection\n");
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv");
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
 
 int send_packet(int socket, struct btide_packet *packet) {
-    uint8_t buffer[PACKET_SIZE];
-    memset(buffer, 0, PACKET_SIZE);
+    return send_packet_framed(socket, packet, PKT_FRAME_FIXED);
+}
 
-    // Serialize the packet
+// Checks the payload fits the framing and writes the header, returns its size
+static int encode_header(struct btide_packet *packet, int framing, uint8_t header[PKT_V1_HDR]) {
     uint16_t msg_code = htons(packet->msg_code);
     uint16_t error = htons(packet->error);
 
-    memcpy(buffer, &msg_code, sizeof(msg_code));
-    memcpy(buffer + sizeof(msg_code), &error, sizeof(error));
-    memcpy(buffer + sizeof(msg_code) + sizeof(error), packet->pl.data, sizeof(packet->pl.data));
+    if (framing == PKT_FRAME_V1) {
+        if (packet->len > PKT_BODY_MAX || (!packet->body && packet->len > PAYLOAD_MAX)) {
+            fprintf(stderr, "Packet payload too large\n");
+            return -1;
+        }
+
+        uint32_t len = htonl(packet->len);
+        header[0] = PKT_V1_MAGIC;
+        header[1] = PKT_FRAME_V1;
+        memcpy(header + 2, &msg_code, sizeof(msg_code));
+        memcpy(header + 4, &error, sizeof(error));
+        memset(header + 6, 0, 2);
+        memcpy(header + 8, &len, sizeof(len));
+        return PKT_V1_HDR;
+    }
+
+    if (packet->len > PAYLOAD_MAX) {
+        fprintf(stderr, "Packet payload too large for fixed framing\n");
+        return -1;
+    }
+    memcpy(header, &msg_code, sizeof(msg_code));
+    memcpy(header + sizeof(msg_code), &error, sizeof(error));
+    return sizeof(msg_code) + sizeof(error);
+}
+
+int send_packet_framed(int socket, struct btide_packet *packet, int framing) {
+    uint8_t header[PKT_V1_HDR];
+    int hlen = encode_header(packet, framing, header);
+    if (hlen < 0) {
+        return -1;
+    }
+
+    if (framing == PKT_FRAME_V1) {
+        // Header and payload go out in a single writev
+        struct iovec iov[2] = {
+            { header, hlen },
+            { packet_payload(packet), packet->len },
+        };
+        return send_all(socket, iov, packet->len ? 2 : 1);
+    }
+
+    uint8_t buffer[PACKET_SIZE];
+    memset(buffer, 0, PACKET_SIZE);
+
+    // Serialize the packet, only the used payload is copied and the rest
+    // of the frame stays zeroed
+    memcpy(buffer, header, hlen);
+    memcpy(buffer + hlen, packet_payload(packet), packet->len);
 
     // Send the packet over the socket
-    ssize_t sent_bytes = send(socket, buffer, PACKET_SIZE, 0);
-    if (sent_bytes != PACKET_SIZE) {
-        perror("send");
+    struct iovec iov = { buffer, PACKET_SIZE };
+    return send_all(socket, &iov, 1);
+}
+
+// Receives one frame of either framing, told apart by the first byte
+int receive_packet(int socket, struct btide_packet *packet) {
+    uint8_t header[PKT_V1_HDR];
+    packet_init(packet, 0);
+
+    if (recv_all(socket, header, 4) < 0) {
         return -1;
     }
 
+    if (header[0] == PKT_V1_MAGIC) {
+        if (recv_all(socket, header + 4, PKT_V1_HDR - 4) < 0) {
+            return -1;
+        }
+        if (header[1] != PKT_FRAME_V1) {
+            fprintf(stderr, "Unsupported frame version %u\n", header[1]);
+            return -1;
+        }
+
+        uint16_t msg_code, error;
+        uint32_t len;
+        memcpy(&msg_code, header + 2, sizeof(msg_code));
+        memcpy(&error, header + 4, sizeof(error));
+        memcpy(&len, header + 8, sizeof(len));
+        packet->msg_code = ntohs(msg_code);
+        packet->error = ntohs(error);
+        packet->len = ntohl(len);
+
+        if (packet->len > PKT_BODY_MAX) {
+            fprintf(stderr, "Oversized packet received\n");
+            return -1;
+        }
+        if (packet->len > PAYLOAD_MAX) {
+            packet->body = malloc(packet->len);
+            if (!packet->body) {
+                fprintf(stderr, "Failed to allocate packet payload\n");
+                return -1;
+            }
+            packet->body_owned = 1;
+        }
+        if (recv_all(socket, packet_payload(packet), packet->len) < 0) {
+            packet_release(packet);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Deserialize a fixed frame
+    memcpy(&packet->msg_code, header, sizeof(packet->msg_code));
+    memcpy(&packet->error, header + sizeof(packet->msg_code), sizeof(packet->error));
+    if (recv_all(socket, packet->pl.data, sizeof(packet->pl.data)) < 0) {
+        return -1;
+    }
+
+    packet->msg_code = ntohs(packet->msg_code);
+    packet->error = ntohs(packet->error);
+    packet->len = PAYLOAD_MAX;
+
     return 0;
 }
 
-int receive_packet(int socket, struct btide_packet *packet) {
-    uint8_t buffer[PACKET_SIZE];
-    ssize_t received_bytes = recv(socket, buffer, PACKET_SIZE, 0);
-    if (received_bytes <= 0) {
-        if (received_bytes == 0) {
-            printf("Peer has closed the connection\n");
+int pkt_reader_init(struct pkt_reader *reader) {
+    reader->start = 0;
+    reader->end = 0;
+    reader->pass_fds = 0;
+    reader->nfds = 0;
+    reader->cap = PKT_READER_INIT;
+    reader->buf = malloc(reader->cap);
+    return reader->buf ? 0 : -1;
+}
+
+void pkt_reader_destroy(struct pkt_reader *reader) {
+    while (reader->nfds > 0) {
+        close(reader->fds[--reader->nfds]);
+    }
+    free(reader->buf);
+    reader->buf = NULL;
+    reader->start = reader->end = reader->cap = 0;
+}
+
+/*
+ * Reads the header of the frame starting at head, of which avail bytes
+ * are at hand. Returns the frame's total size and sets its code and
+ * header length, or returns 0 if the header is not all there yet.
+ */
+size_t pkt_frame_peek(const uint8_t *head, size_t avail, uint16_t *msg_code, size_t *hdr_len) {
+    uint16_t code;
+    if (avail > 0 && head[0] != PKT_V1_MAGIC) {
+        if (avail < 2 * sizeof(uint16_t)) {
+            return 0;
+        }
+        memcpy(&code, head, sizeof(code));
+        *msg_code = ntohs(code);
+        *hdr_len = 2 * sizeof(uint16_t);
+        return PACKET_SIZE;
+    }
+    if (avail < PKT_V1_HDR) {
+        return 0;
+    }
+    uint32_t len;
+    memcpy(&code, head + 2, sizeof(code));
+    memcpy(&len, head + 8, sizeof(len));
+    *msg_code = ntohs(code);
+    *hdr_len = PKT_V1_HDR;
+    return PKT_V1_HDR + ntohl(len);
+}
+
+// Size of the frame at the head of the buffer, 0 if not known yet
+static size_t pending_frame_size(struct pkt_reader *reader) {
+    size_t avail = reader->end - reader->start;
+    uint8_t *head = reader->buf + reader->start;
+    if (avail == 0) {
+        return 0;
+    }
+    uint16_t msg_code;
+    size_t hdr_len;
+    size_t size = pkt_frame_peek(head, avail, &msg_code, &hdr_len);
+    if (size == 0) {
+        return head[0] == PKT_V1_MAGIC ? PKT_V1_HDR : PACKET_SIZE;
+    }
+    return size;
+}
+
+/*
+ * Receives like recv, keeping any descriptors that came with the bytes.
+ * Fails with EPROTO if more arrive than the reader can hold.
+ */
+static ssize_t recv_fds(struct pkt_reader *reader, int socket, size_t room, int flags) {
+    struct iovec iov = { .iov_base = reader->buf + reader->end, .iov_len = room };
+    union {
+        struct cmsghdr hdr;
+        uint8_t buf[CMSG_SPACE(sizeof(int) * PKT_READER_FDS_MAX)];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+    ssize_t n = recvmsg(socket, &msg, flags | MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+        return n;
+    }
+
+    int overflow = (msg.msg_flags & MSG_CTRUNC) != 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (reader->nfds < PKT_READER_FDS_MAX) {
+                reader->fds[reader->nfds++] = fd;
+            } else {
+                close(fd);
+                overflow = 1;
+            }
+        }
+    }
+    if (overflow) {
+        fprintf(stderr, "Too many descriptors received\n");
+        errno = EPROTO;
+        return -1;
+    }
+    return n;
+}
+
+// Takes the oldest descriptor received, -1 if there is none
+int pkt_reader_take_fd(struct pkt_reader *reader) {
+    if (reader->nfds == 0) {
+        return -1;
+    }
+    int fd = reader->fds[0];
+    memmove(reader->fds, reader->fds + 1, --reader->nfds * sizeof(int));
+    return fd;
+}
+
+/*
+ * Reads everything the socket has available into the buffer. Blocking
+ * sockets wait for the first bytes only, later reads use MSG_DONTWAIT.
+ * Returns the number of bytes read, 0 once the peer has closed, or -1 on
+ * error (errno EAGAIN when a non-blocking socket had nothing to read).
+ */
+int pkt_reader_fill(struct pkt_reader *reader, int socket) {
+    // Drop consumed bytes so the partial frame starts the buffer
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+
+    int total = 0;
+    int flags = 0;
+    while (1) {
+        // Grow to fit the frame being assembled, a full buffer of whole
+        // frames is handed back to the caller to drain first
+        size_t need = pending_frame_size(reader);
+        if (need > PKT_V1_HDR + PKT_BODY_MAX) {
+            fprintf(stderr, "Oversized packet received\n");
+            errno = EPROTO;
+            return -1;
+        }
+        if (reader->end == reader->cap && need <= reader->cap && total > 0) {
+            return total;
+        }
+        if (need > reader->cap || reader->end == reader->cap) {
+            size_t cap = reader->cap * 2 > need ? reader->cap * 2 : need;
+            uint8_t *buf = realloc(reader->buf, cap);
+            if (!buf) {
+                errno = ENOMEM;
+                return -1;
+            }
+            reader->buf = buf;
+            reader->cap = cap;
+        }
+
+        size_t room = reader->cap - reader->end;
+        ssize_t n = reader->pass_fds ? recv_fds(reader, socket, room, flags)
+                                     : recv(socket, reader->buf + reader->end, room, flags);
+        if (n > 0) {
+            reader->end += n;
+            total += n;
+            flags = MSG_DONTWAIT;
+            // Frames that came with descriptors are handled before more arrive
+            if ((size_t)n < room || reader->nfds > 0) {
+                return total;
+            }
+            continue;
+        }
+        if (n == 0) {
+            return total;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno == EAGAIN || errno == EWOULDBLOCK) && total > 0) {
+            return total;
+        }
+        return -1;
+    }
+}
+
+/*
+ * Extracts the next complete frame. Returns 1 with the packet filled in, 0
+ * when more bytes are needed, or -1 on a malformed frame. Payloads beyond
+ * PAYLOAD_MAX point into the buffer and stay valid until the next fill.
+ */
+int pkt_reader_next(struct pkt_reader *reader, struct btide_packet *packet) {
+    size_t need = pending_frame_size(reader);
+    if (need == 0 || reader->end - reader->start < need) {
+        return 0;
+    }
+
+    uint8_t *head = reader->buf + reader->start;
+    packet_init(packet, 0);
+
+    if (head[0] == PKT_V1_MAGIC) {
+        if (head[1] != PKT_FRAME_V1) {
+            fprintf(stderr, "Unsupported frame version %u\n", head[1]);
+            return -1;
+        }
+        uint16_t msg_code, error;
+        memcpy(&msg_code, head + 2, sizeof(msg_code));
+        memcpy(&error, head + 4, sizeof(error));
+        packet->msg_code = ntohs(msg_code);
+        packet->error = ntohs(error);
+        packet->len = need - PKT_V1_HDR;
+        if (packet->len > PAYLOAD_MAX) {
+            packet->body = head + PKT_V1_HDR;
         } else {
-            perror("recv");
+            memcpy(packet->pl.data, head + PKT_V1_HDR, packet->len);
+        }
+    } else {
+        uint16_t msg_code, error;
+        memcpy(&msg_code, head, sizeof(msg_code));
+        memcpy(&error, head + sizeof(msg_code), sizeof(error));
+        packet->msg_code = ntohs(msg_code);
+        packet->error = ntohs(error);
+        packet->len = PAYLOAD_MAX;
+        memcpy(packet->pl.data, head + sizeof(msg_code) + sizeof(error), PAYLOAD_MAX);
+    }
+
+    reader->start += need;
+    return 1;
+}
+
+int pkt_writer_init(struct pkt_writer *writer) {
+    writer->start = 0;
+    writer->end = 0;
+    writer->cap = PACKET_SIZE;
+    writer->file_bytes = 0;
+    writer->files = NULL;
+    writer->files_tail = NULL;
+    writer->buf = malloc(writer->cap);
+    return writer->buf ? 0 : -1;
+}
+
+void pkt_writer_destroy(struct pkt_writer *writer) {
+    while (writer->files) {
+        struct pkt_file_segment *seg = writer->files;
+        writer->files = seg->next;
+        close(seg->fd);
+        free(seg);
+    }
+    free(writer->buf);
+    writer->buf = NULL;
+    writer->start = writer->end = writer->cap = 0;
+    writer->files_tail = NULL;
+    writer->file_bytes = 0;
+}
+
+size_t pkt_writer_pending(struct pkt_writer *writer) {
+    return writer->end - writer->start + writer->file_bytes;
+}
+
+// Buffered bytes that can go out before the next file segment
+size_t pkt_writer_inline(struct pkt_writer *writer, uint8_t **data) {
+    size_t limit = writer->files ? writer->files->at : writer->end;
+    *data = writer->buf + writer->start;
+    return limit - writer->start;
+}
+
+// Drops len bytes that were sent by other means than pkt_writer_flush
+void pkt_writer_consume(struct pkt_writer *writer, size_t len) {
+    writer->start += len;
+    if (writer->start == writer->end && !writer->files) {
+        writer->start = writer->end = 0;
+    }
+}
+
+// Makes room for len more bytes, file segments keep their place in the stream
+static int reserve(struct pkt_writer *writer, size_t len) {
+    if (writer->start > 0 && writer->start == writer->end && !writer->files) {
+        writer->start = writer->end = 0;
+    }
+    if (writer->end + len <= writer->cap) {
+        return 0;
+    }
+
+    // Reclaim written bytes before growing
+    memmove(writer->buf, writer->buf + writer->start, writer->end - writer->start);
+    for (struct pkt_file_segment *seg = writer->files; seg; seg = seg->next) {
+        seg->at -= writer->start;
+    }
+    writer->end -= writer->start;
+    writer->start = 0;
+    if (writer->end + len > writer->cap) {
+        size_t cap = writer->cap;
+        while (cap < writer->end + len) {
+            cap *= 2;
+        }
+        uint8_t *buf = realloc(writer->buf, cap);
+        if (!buf) {
+            fprintf(stderr, "Failed to grow output buffer\n");
+            return -1;
+        }
+        writer->buf = buf;
+        writer->cap = cap;
+    }
+    return 0;
+}
+
+// Serializes a packet behind whatever is still waiting to be written
+int pkt_writer_queue(struct pkt_writer *writer, struct btide_packet *packet, int framing) {
+    return pkt_writer_queue_parts(writer, packet, packet->len, NULL, framing);
+}
+
+/*
+ * Queues a frame whose payload is the first inline_len bytes of the packet
+ * followed by the rest of packet->len taken from data, so a header and
+ * data held elsewhere need not be joined first.
+ */
+int pkt_writer_queue_parts(struct pkt_writer *writer, struct btide_packet *packet, size_t inline_len,
+                           const uint8_t *data, int framing) {
+    uint8_t header[PKT_V1_HDR];
+    int hlen = encode_header(packet, framing, header);
+    if (hlen < 0 || inline_len > packet->len) {
+        return -1;
+    }
+    size_t frame = framing == PKT_FRAME_V1 ? (size_t)hlen + packet->len : PACKET_SIZE;
+    if (reserve(writer, frame) < 0) {
+        return -1;
+    }
+
+    uint8_t *out = writer->buf + writer->end;
+    memcpy(out, header, hlen);
+    memcpy(out + hlen, packet_payload(packet), inline_len);
+    if (packet->len > inline_len) {
+        memcpy(out + hlen + inline_len, data, packet->len - inline_len);
+    }
+    if (framing != PKT_FRAME_V1) {
+        memset(out + hlen + packet->len, 0, frame - hlen - packet->len);
+    }
+    writer->end += frame;
+    return 0;
+}
+
+/*
+ * Queues a length-prefixed frame whose payload is the first inline_len
+ * bytes of the packet followed by the rest of packet->len read from fd at
+ * offset. The file bytes are sent with sendfile and never copied here.
+ */
+int pkt_writer_queue_file(struct pkt_writer *writer, struct btide_packet *packet, size_t inline_len,
+                          int fd, off_t offset) {
+    uint8_t header[PKT_V1_HDR];
+    if (inline_len > packet->len || encode_header(packet, PKT_FRAME_V1, header) < 0) {
+        return -1;
+    }
+
+    struct pkt_file_segment *seg = malloc(sizeof(struct pkt_file_segment));
+    if (!seg) {
+        return -1;
+    }
+    // The segment keeps its own descriptor in case the package is removed
+    seg->fd = dup(fd);
+    if (seg->fd < 0 || reserve(writer, PKT_V1_HDR + inline_len) < 0) {
+        if (seg->fd >= 0) {
+            close(seg->fd);
         }
+        free(seg);
         return -1;
     }
 
-    if (received_bytes != PACKET_SIZE) {
-        fprintf(stderr, "Incomplete packet received\n");
+    memcpy(writer->buf + writer->end, header, PKT_V1_HDR);
+    memcpy(writer->buf + writer->end + PKT_V1_HDR, packet_payload(packet), inline_len);
+    writer->end += PKT_V1_HDR + inline_len;
+
+    seg->at = writer->end;
+    seg->offset = offset;
+    seg->len = packet->len - inline_len;
+    seg->pass = 0;
+    seg->next = NULL;
+    if (writer->files_tail) {
+        writer->files_tail->next = seg;
+    } else {
+        writer->files = seg;
+    }
+    writer->files_tail = seg;
+    writer->file_bytes += seg->len;
+    return 0;
+}
+
+/*
+ * Queues a frame that carries a copy of fd to the peer, attached to the
+ * frame's first byte. Only a Unix domain socket can carry it, and the
+ * peer receives descriptors in the order of the frames they came with.
+ */
+int pkt_writer_queue_fd(struct pkt_writer *writer, struct btide_packet *packet, int framing, int fd) {
+    struct pkt_file_segment *seg = malloc(sizeof(struct pkt_file_segment));
+    if (!seg) {
+        return -1;
+    }
+    seg->fd = dup(fd);
+    if (seg->fd < 0) {
+        free(seg);
         return -1;
     }
+    // Space is made first so the segment's position survives the compaction
+    uint8_t header[PKT_V1_HDR];
+    int hlen = encode_header(packet, framing, header);
+    size_t frame = framing == PKT_FRAME_V1 ? (size_t)hlen + packet->len : PACKET_SIZE;
+    if (hlen < 0 || reserve(writer, frame) < 0) {
+        close(seg->fd);
+        free(seg);
+        return -1;
+    }
+    seg->at = writer->end;
+    if (pkt_writer_queue(writer, packet, framing) < 0) {
+        close(seg->fd);
+        free(seg);
+        return -1;
+    }
+    seg->offset = 0;
+    seg->len = 0;
+    seg->pass = 1;
+    seg->next = NULL;
+    if (writer->files_tail) {
+        writer->files_tail->next = seg;
+    } else {
+        writer->files = seg;
+    }
+    writer->files_tail = seg;
+    return 0;
+}
 
-    // Deserialize the packet
-    memcpy(&packet->msg_code, buffer, sizeof(packet->msg_code));
-    memcpy(&packet->error, buffer + sizeof(packet->msg_code), sizeof(packet->error));
-    memcpy(packet->pl.data, buffer + sizeof(packet->msg_code) + sizeof(packet->error), sizeof(packet->pl.data));
+// Sends up to len bytes with a copy of fd attached to the first
+static ssize_t send_fd(int socket, const uint8_t *data, size_t len, int fd) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    union {
+        struct cmsghdr hdr;
+        uint8_t buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(socket, &msg, MSG_NOSIGNAL);
+}
 
-    packet->msg_code = ntohs(packet->msg_code);
-    packet->error = ntohs(packet->error);
+/*
+ * Writes as much as the socket accepts, but no more than budget bytes, and
+ * adds what went out to *sent. Returns 1 if bytes remain queued.
+ */
+int pkt_writer_flush_some(struct pkt_writer *writer, int socket, size_t budget, size_t *sent) {
+    size_t total = 0;
+    if (!sent) {
+        sent = &total;
+    }
+    size_t start = *sent;
+    while (1) {
+        // Buffered bytes up to the next file segment, or all of them
+        size_t limit = writer->files ? writer->files->at : writer->end;
+        while (writer->start < limit && *sent - start < budget) {
+            size_t len = limit - writer->start;
+            if (len > budget - (*sent - start)) {
+                len = budget - (*sent - start);
+            }
+            int flags = MSG_NOSIGNAL | (writer->files || len < limit - writer->start ? MSG_MORE : 0);
+            ssize_t n = send(socket, writer->buf + writer->start, len, flags);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 1;
+                }
+                perror("send");
+                return -1;
+            }
+            writer->start += n;
+            *sent += n;
+        }
+        if (writer->start < limit || !writer->files) {
+            break;
+        }
+
+        struct pkt_file_segment *seg = writer->files;
+        if (seg->pass) {
+            // The descriptor goes with the bytes up to the next segment
+            if (*sent - start >= budget) {
+                break;
+            }
+            size_t limit = seg->next ? seg->next->at : writer->end;
+            size_t len = limit - writer->start;
+            if (len > budget - (*sent - start)) {
+                len = budget - (*sent - start);
+            }
+            ssize_t n = send_fd(socket, writer->buf + writer->start, len, seg->fd);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 1;
+                }
+                perror("sendmsg");
+                return -1;
+            }
+            writer->start += n;
+            *sent += n;
+        }
+        while (seg->len > 0 && *sent - start < budget) {
+            size_t len = budget - (*sent - start);
+            ssize_t n = sendfile(socket, seg->fd, &seg->offset, seg->len < len ? seg->len : len);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 1;
+                }
+                perror("sendfile");
+                return -1;
+            }
+            if (n == 0) {
+                // The file shrank under us, the frame can no longer be completed
+                fprintf(stderr, "Data file truncated while sending\n");
+                return -1;
+            }
+            seg->len -= n;
+            writer->file_bytes -= n;
+            *sent += n;
+        }
+        if (seg->len > 0) {
+            break;
+        }
 
+        writer->files = seg->next;
+        if (!writer->files) {
+            writer->files_tail = NULL;
+        }
+        close(seg->fd);
+        free(seg);
+    }
+    if (pkt_writer_pending(writer) > 0) {
+        // Stopped by the budget
+        return 1;
+    }
+    writer->start = writer->end = 0;
     return 0;
 }
+
+// Writes as much as the socket accepts, returns 1 if bytes remain queued
+int pkt_writer_flush(struct pkt_writer *writer, int socket) {
+    return pkt_writer_flush_some(writer, socket, SIZE_MAX, NULL);
+}
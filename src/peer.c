@@ -1,52 +1,241 @@
 #include "../include/peer/peer.h"
+#include "../include/peer/dial.h"
+#include "../include/config/config.h"
+#include "../include/net/uring.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
+#define PEER_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+#define PEER_BUCKETS_INIT (64)
+
+/*
+ * The registry belongs to the reactor thread, the only thread that touches
+ * peers. Removal unlinks a peer straight away but leaves its next pointer
+ * intact and frees it only once the current event batch is done, so a
+ * walk that is holding the peer, or stepping past it, never lands on
+ * freed memory. Lookups by address and by socket go through hash indexes.
+ */
 static struct peer *peer_list = NULL;
+static struct peer *peer_tail = NULL;
+static struct peer **addr_buckets = NULL;
+static struct peer **fd_buckets = NULL;
+static size_t nbuckets = 0;
+static size_t npeers = 0;
+static struct peer *flush_list = NULL;
+static struct peer *flush_tail = NULL;
+static struct peer *parked = NULL;      // Stopped by their limits this round, rejoin the list after it
+static struct peer *parked_tail = NULL;
+static struct token_bucket up_all;      // Global limits, each peer also has its own buckets
+static struct token_bucket down_all;
+static int paced = 0;                   // An upload limit is set, all sends go through the scheduler
+static struct reactor_handler pace_handler;
+extern Config config;
+static peer_packet_fn packet_handler = NULL;
+static peer_drain_fn drain_handler = NULL;
+static peer_remove_fn remove_handler = NULL;
+
+static void free_peer(void *ptr) {
+    struct peer *peer = ptr;
+    peer_drop_jobs(peer);
+    pkt_reader_destroy(&peer->rx);
+    pkt_writer_destroy(&peer->tx);
+    inflight_destroy(&peer->inflight);
+    while (peer->avail) {
+        struct peer_avail *avail = peer->avail;
+        peer->avail = avail->next;
+        bitmap_destroy(&avail->have);
+        bitmap_destroy(&avail->failed);
+        free(avail);
+    }
+    free(peer);
+}
+
+// FNV-1a over the address text and port
+static size_t addr_hash(const char *ip, int port) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = ip; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    hash = (hash ^ (uint32_t)port) * 16777619u;
+    return hash & (nbuckets - 1);
+}
+
+static size_t fd_hash(int fd) {
+    return ((uint32_t)fd * 2654435761u) & (nbuckets - 1);
+}
+
+static void index_peer(struct peer *peer) {
+    size_t a = addr_hash(peer->ip, peer->port);
+    peer->addr_next = addr_buckets[a];
+    addr_buckets[a] = peer;
+    size_t f = fd_hash(peer->socket);
+    peer->fd_next = fd_buckets[f];
+    fd_buckets[f] = peer;
+}
+
+// Doubles the indexes once they average more than one peer per bucket
+static int grow_index() {
+    size_t size = nbuckets ? nbuckets * 2 : PEER_BUCKETS_INIT;
+    struct peer **addr = calloc(size, sizeof(struct peer *));
+    struct peer **fd = calloc(size, sizeof(struct peer *));
+    if (!addr || !fd) {
+        free(addr);
+        free(fd);
+        return -1;
+    }
+    free(addr_buckets);
+    free(fd_buckets);
+    addr_buckets = addr;
+    fd_buckets = fd;
+    nbuckets = size;
+    for (struct peer *peer = peer_list; peer; peer = peer->next) {
+        index_peer(peer);
+    }
+    return 0;
+}
+
+static void unindex_peer(struct peer *peer) {
+    if (!nbuckets) {
+        return;
+    }
+    struct peer **slot = &addr_buckets[addr_hash(peer->ip, peer->port)];
+    while (*slot && *slot != peer) {
+        slot = &(*slot)->addr_next;
+    }
+    if (*slot) {
+        *slot = peer->addr_next;
+    }
+    slot = &fd_buckets[fd_hash(peer->socket)];
+    while (*slot && *slot != peer) {
+        slot = &(*slot)->fd_next;
+    }
+    if (*slot) {
+        *slot = peer->fd_next;
+    }
+}
 
-// Function to add a peer
+// Function to add a peer to the end of the list and the lookup indexes
 void add_peer(struct peer *new_peer) {
-    // List Traversal, keeping tack of peers
     new_peer->next = NULL;
-    if (!peer_list) {
+    new_peer->prev = peer_tail;
+    if (peer_tail) {
+        peer_tail->next = new_peer;
+    } else {
         peer_list = new_peer;
+    }
+    peer_tail = new_peer;
+    npeers++;
+
+    // Growing rebuilds the indexes from the list, new peer included
+    if (npeers > nbuckets && grow_index() == 0) {
+        return;
+    }
+    if (nbuckets) {
+        index_peer(new_peer);
+    }
+}
+
+static void append_flush(struct peer **head, struct peer **tail, struct peer *peer) {
+    peer->flush_next = NULL;
+    if (*tail) {
+        (*tail)->flush_next = peer;
     } else {
-        struct peer *current = peer_list;
-        while (current->next) {
-            current = current->next;
+        *head = peer;
+    }
+    *tail = peer;
+}
+
+static void unlink_flush(struct peer **head, struct peer **tail, struct peer *peer) {
+    struct peer *prev = NULL;
+    for (struct peer *current = *head; current; prev = current, current = current->flush_next) {
+        if (current == peer) {
+            if (prev) {
+                prev->flush_next = peer->flush_next;
+            } else {
+                *head = peer->flush_next;
+            }
+            if (*tail == peer) {
+                *tail = prev;
+            }
+            return;
         }
-        current->next = new_peer;
     }
 }
 
-// Function to remove a peer
+// Function to remove a peer, it is freed once the current event batch is done
 void remove_peer(struct peer *peer_to_remove) {
-    struct peer **current = &peer_list;
-    // Find peer to remove
-    while (*current && *current != peer_to_remove) {
-        current = &(*current)->next;
+    if (peer_to_remove->closed) {
+        return;
+    }
+    struct peer *to_free = peer_to_remove;
+    // Unlink peer, its own next pointer stays valid for walks already past it
+    if (to_free->prev) {
+        to_free->prev->next = to_free->next;
+    } else {
+        peer_list = to_free->next;
+    }
+    if (to_free->next) {
+        to_free->next->prev = to_free->prev;
+    } else {
+        peer_tail = to_free->prev;
     }
-    if (*current) {
-        struct peer *to_free = *current;
-        // Unlink peer
-        *current = (*current)->next;
-        close(to_free->socket);
-        free(to_free);
+    unindex_peer(to_free);
+    npeers--;
+    // Rate limited peers can wait on the send list across loop iterations
+    if (to_free->flush_queued) {
+        unlink_flush(&flush_list, &flush_tail, to_free);
+        unlink_flush(&parked, &parked_tail, to_free);
+        to_free->flush_queued = 0;
     }
+
+    reactor_del(&to_free->handler);
+    close(to_free->socket);
+    // Events for this peer may still be pending in the current batch
+    to_free->closed = 1;
+    inflight_abort(to_free);
+    // Nothing may keep pointing at the peer once it is freed
+    if (remove_handler) {
+        remove_handler(to_free);
+    }
+    // A peer we dialed that dropped is dialed again, one that stayed up a while from a short backoff
+    if (to_free->redial) {
+        int stable = reactor_now_ms() - to_free->connected_ms >= DIAL_STABLE_MS;
+        dial_retry(to_free->ip, to_free->port, stable ? 0 : to_free->retries);
+    }
+    reactor_defer_free(to_free, free_peer);
 }
 
 // Function to find a peer by IP and port
 struct peer *find_peer(const char *ip, int port) {
-    struct peer *current = peer_list;
-    while (current) {
+    if (!nbuckets) {
+        return NULL;
+    }
+    for (struct peer *current = addr_buckets[addr_hash(ip, port)]; current; current = current->addr_next) {
         // Compare IP and Port Number
         if (strcmp(current->ip, ip) == 0 && current->port == port) {
             return current;
         }
-        current = current->next;
+    }
+    return NULL;
+}
+
+// Function to find a peer by its socket
+struct peer *find_peer_by_fd(int fd) {
+    if (!nbuckets) {
+        return NULL;
+    }
+    for (struct peer *current = fd_buckets[fd_hash(fd)]; current; current = current->fd_next) {
+        if (current->socket == fd) {
+            return current;
+        }
     }
     return NULL;
 }
@@ -56,91 +245,786 @@ struct peer *get_peer_list() {
     return peer_list;
 }
 
-// Function to connect to a peer
-int connect_to_peer(const char *ip, int port) {
-    // Create socket
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        perror("Socket creation failed");
-        return -1;
+int peer_count() {
+    return (int)npeers;
+}
+
+// Past this much queued output we stop taking requests from the peer
+static size_t queue_limit() {
+    return (size_t)config.peer_queue_kib * 1024;
+}
+
+// Output queued for the peer and output its pending requests will produce
+static size_t backlog(struct peer *peer) {
+    return pkt_writer_pending(&peer->tx) + peer->job_bytes;
+}
+
+static void peer_on_event(void *ctx, uint32_t events);
+static void resume_if_drained(struct peer *peer);
+static void read_frames(struct peer *peer);
+
+/*
+ * A Unix domain socket with a path on either end leads to a btide on this
+ * host. The unnamed socketpairs behind UDP peers do not.
+ */
+static int is_local(int sockfd) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(sockfd, (struct sockaddr *)&addr, &addr_len) < 0 || addr.ss_family != AF_UNIX) {
+        return 0;
+    }
+    if (addr_len > sizeof(sa_family_t)) {
+        return 1;
     }
+    addr_len = sizeof(addr);
+    return getpeername(sockfd, (struct sockaddr *)&addr, &addr_len) == 0 && addr_len > sizeof(sa_family_t);
+}
 
-    // Server address structure
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET; // Set address family
-    server_addr.sin_port = htons(port); // Set port number
-    // Convert IP address to binary
-    if (inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0) {
-        perror("Invalid address/Address not supported");
+// Wraps a connected socket in a peer and registers it with the reactor
+struct peer *peer_register(int sockfd, const char *ip, int port) {
+    struct peer *new_peer = (struct peer *)calloc(1, sizeof(struct peer));
+    if (!new_peer) {
+        fprintf(stderr, "Failed to allocate peer\n");
         close(sockfd);
-        return -1;
+        return NULL;
     }
-
-    // Connect to Server
-    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
+    if (pkt_reader_init(&new_peer->rx) != 0 || pkt_writer_init(&new_peer->tx) != 0 ||
+        inflight_init(&new_peer->inflight, config.request_window) != 0) {
+        fprintf(stderr, "Failed to allocate peer buffers\n");
         close(sockfd);
-        return -1;
+        free_peer(new_peer);
+        return NULL;
     }
 
-    // Add peer to the list
-    struct peer *new_peer = (struct peer *)malloc(sizeof(struct peer));
-    strcpy(new_peer->ip, ip); // Copy IP
+    snprintf(new_peer->ip, INET_ADDRSTRLEN, "%s", ip); // Copy IP
     new_peer->port = port; // Set Port
     new_peer->socket = sockfd; // Set Socket File Descriptor
+    new_peer->framing = PKT_FRAME_FIXED;
+    new_peer->handler.fd = sockfd;
+    new_peer->handler.fn = peer_on_event;
+    new_peer->handler.ctx = new_peer;
+    new_peer->last_heard_ms = reactor_now_ms();
+    new_peer->connected_ms = new_peer->last_heard_ms;
+    bucket_init(&new_peer->up, config.peer_upload_kibps, new_peer->last_heard_ms);
+    bucket_init(&new_peer->down, config.peer_download_kibps, new_peer->last_heard_ms);
+    if (is_local(sockfd)) {
+        new_peer->local = 1;
+        new_peer->rx.pass_fds = 1;
+    }
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(sockfd, (struct sockaddr *)&addr, &addr_len) == 0 && addr.ss_family == AF_INET) {
+        // Output is already gathered per loop iteration, Nagle would only hold the last frame back
+        int one = 1;
+        new_peer->tcp = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    if (reactor_add(&new_peer->handler, PEER_EVENTS) < 0) {
+        perror("epoll_ctl");
+        close(sockfd);
+        free_peer(new_peer);
+        return NULL;
+    }
     add_peer(new_peer);
 
-    return sockfd;
+    // Offer length-prefixed framing, legacy peers never answer
+    peer_send_hello(new_peer);
+    return new_peer;
 }
 
-// Function to accept a connection
+// Tells a connection we cannot take it why, in a frame every peer understands
+void peer_reject(int sockfd) {
+    struct btide_packet dsn_packet;
+    packet_init(&dsn_packet, PKT_MSG_DSN);
+    dsn_packet.error = PKT_DSN_FULL;
+    dsn_packet.len = snprintf((char *)dsn_packet.pl.data, sizeof(dsn_packet.pl.data), "Peer limit reached") + 1;
+
+    // A fresh socket has an empty send buffer, the frame goes out at once
+    send_packet(sockfd, &dsn_packet);
+    close(sockfd);
+}
+
+/*
+ * Function to accept a connection. Returns the socket, PEER_REJECTED when
+ * max_peers is reached, PEER_FAILED when this connection could not be
+ * taken, or -1 once drained. The listening socket is edge triggered, so
+ * the caller keeps going until -1. Running out of descriptors or memory
+ * also returns -1, retrying at once could not succeed.
+ */
 int accept_connection(int listening_socket) {
     struct sockaddr_in client_addr;
     socklen_t addr_len = sizeof(client_addr);
     // Accept Connection
-    int new_socket = accept(listening_socket, (struct sockaddr *)&client_addr, &addr_len);
+    int new_socket;
+    do {
+        addr_len = sizeof(client_addr);
+        new_socket = accept(listening_socket, (struct sockaddr *)&client_addr, &addr_len);
+    } while (new_socket < 0 && errno == EINTR);
     if (new_socket < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
         perror("Accept failed");
-        return -1;
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+            return -1;
+        }
+        return PEER_FAILED;
     }
 
-    // Allocate memory for the new peer
-    struct peer *new_peer = (struct peer *)malloc(sizeof(struct peer));
-    inet_ntop(AF_INET, &client_addr.sin_addr, new_peer->ip, INET_ADDRSTRLEN);
-    new_peer->port = ntohs(client_addr.sin_port);
-    new_peer->socket = new_socket;
-    add_peer(new_peer);
+    if (npeers >= (size_t)config.max_peers) {
+        peer_reject(new_socket);
+        return PEER_REJECTED;
+    }
 
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr.sin_addr, ip, INET_ADDRSTRLEN);
+    if (!peer_register(new_socket, ip, ntohs(client_addr.sin_port))) {
+        return PEER_FAILED;
+    }
     return new_socket;
 }
 
 // Function to disconnect a peer
 void disconnect_peer(struct peer *peer) {
     struct btide_packet dsn_packet;
-    dsn_packet.msg_code = PKT_MSG_DSN;
-    dsn_packet.error = 0;
-    memset(dsn_packet.pl.data, 0, PAYLOAD_MAX);
+    packet_init(&dsn_packet, PKT_MSG_DSN);
 
-    send(peer->socket, &dsn_packet, sizeof(dsn_packet), 0);
-    close(peer->socket);
+    // Flushed here, the socket is closed before the end of the iteration
+    peer->redial = 0;
+    if (!peer->closed && pkt_writer_queue(&peer->tx, &dsn_packet, peer->framing) == 0) {
+        pkt_writer_flush(&peer->tx, peer->socket);
+    }
     remove_peer(peer);
 }
 
-void check_for_disconnection(int peer_socket) {
-    char buffer[1];
-    int result = recv(peer_socket, buffer, sizeof(buffer), MSG_PEEK);
-    if (result == 0) {
-        // Connection closed by peer
-        struct peer *peer = peer_list;
-        while (peer) {
-            if (peer->socket == peer_socket) {
-                printf("Peer disconnected.\n");
-                remove_peer(peer);
+// Function to set where packets other than DSN, PING and PONG are delivered
+void peer_set_packet_handler(peer_packet_fn fn) {
+    packet_handler = fn;
+}
+
+// Function to set who turns a peer's jobs into output once its queue has room
+void peer_set_drain_handler(peer_drain_fn fn) {
+    drain_handler = fn;
+}
+
+// Function to set who forgets a peer as it is removed, before it is freed
+void peer_set_remove_handler(peer_remove_fn fn) {
+    remove_handler = fn;
+}
+
+void peer_drop_jobs(struct peer *peer) {
+    while (peer->jobs) {
+        struct serve_job *job = peer->jobs;
+        peer->jobs = job->next;
+        free(job);
+    }
+    peer->jobs_tail = NULL;
+    peer->job_bytes = 0;
+}
+
+/*
+ * Called once output has gone out. Never from a send itself, the drain
+ * handler sends and would re-enter.
+ */
+static void drained(struct peer *peer) {
+    if (drain_handler && peer->jobs && !peer->closed) {
+        drain_handler(peer);
+    }
+}
+
+static void queue_flush(struct peer *peer) {
+    if (!peer->flush_queued) {
+        peer->flush_queued = 1;
+        append_flush(&flush_list, &flush_tail, peer);
+    }
+}
+
+/*
+ * The send is left for peer_flush_queued, which runs at the end of the
+ * loop iteration, so every frame queued for the peer while handling one
+ * batch of events goes out in one send instead of one each.
+ */
+static int flush_or_defer(struct peer *peer) {
+    queue_flush(peer);
+    return 0;
+}
+
+/*
+ * Stamps the queued PING once the bytes ahead of it and its own have been
+ * written, so the time it spent behind bulk output is not counted as RTT.
+ */
+static void note_written(struct peer *peer, size_t len) {
+    if (peer->ping_ahead == 0) {
+        return;
+    }
+    if (len < peer->ping_ahead) {
+        peer->ping_ahead -= len;
+        return;
+    }
+    peer->ping_ahead = 0;
+    peer->ping_wire_ms = reactor_now_ms();
+}
+
+/*
+ * Drops a peer whose socket refused our output. A peer that turned us
+ * away said why before closing, its last frames are handled first so a
+ * DSN is not lost to the failed send.
+ */
+static void send_failed(struct peer *peer) {
+    read_frames(peer);
+    if (!peer->closed) {
+        remove_peer(peer);
+    }
+}
+
+/*
+ * Writes the peer's output like pkt_writer_flush_some. A TCP socket is
+ * corked while file segments are in the queue, so the headers sent
+ * before each sendfile share full segments with the file bytes.
+ */
+static int flush_peer(struct peer *peer, size_t budget, size_t *sent) {
+    int cork = peer->tcp && peer->tx.files;
+    int on = 1;
+    int off = 0;
+    size_t before = pkt_writer_pending(&peer->tx);
+    if (cork) {
+        setsockopt(peer->socket, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    }
+    int rc = pkt_writer_flush_some(&peer->tx, peer->socket, budget, sent);
+    if (cork) {
+        setsockopt(peer->socket, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    }
+    note_written(peer, before - pkt_writer_pending(&peer->tx));
+    return rc;
+}
+
+// Sends a packet using the framing negotiated with the peer
+int peer_send(struct peer *peer, struct btide_packet *packet) {
+    size_t before = pkt_writer_pending(&peer->tx);
+    if (peer->closed || pkt_writer_queue(&peer->tx, packet, peer->framing) < 0) {
+        return -1;
+    }
+    peer->tx_bytes += pkt_writer_pending(&peer->tx) - before;
+    return flush_or_defer(peer);
+}
+
+// Sends a frame whose payload ends with file bytes, see pkt_writer_queue_file
+int peer_send_file(struct peer *peer, struct btide_packet *packet, size_t inline_len, int fd, off_t offset) {
+    size_t before = pkt_writer_pending(&peer->tx);
+    if (peer->closed || peer->framing != PKT_FRAME_V1 ||
+        pkt_writer_queue_file(&peer->tx, packet, inline_len, fd, offset) < 0) {
+        return -1;
+    }
+    peer->tx_bytes += pkt_writer_pending(&peer->tx) - before;
+    return flush_or_defer(peer);
+}
+
+// Sends a frame with a descriptor attached, only over a local connection that offered FDPASS
+int peer_send_fd(struct peer *peer, struct btide_packet *packet, int fd) {
+    size_t before = pkt_writer_pending(&peer->tx);
+    if (peer->closed || !peer->local || !(peer->features & PKT_FEAT_FDPASS) ||
+        pkt_writer_queue_fd(&peer->tx, packet, peer->framing, fd) < 0) {
+        return -1;
+    }
+    peer->tx_bytes += pkt_writer_pending(&peer->tx) - before;
+    return flush_or_defer(peer);
+}
+
+// Takes the descriptor that came with the frame being handled, -1 if none did
+int peer_take_fd(struct peer *peer) {
+    return pkt_reader_take_fd(&peer->rx);
+}
+
+// Sends a frame whose payload ends with bytes from data, see pkt_writer_queue_parts
+int peer_send_parts(struct peer *peer, struct btide_packet *packet, size_t inline_len, const uint8_t *data) {
+    size_t before = pkt_writer_pending(&peer->tx);
+    if (peer->closed || pkt_writer_queue_parts(&peer->tx, packet, inline_len, data, peer->framing) < 0) {
+        return -1;
+    }
+    peer->tx_bytes += pkt_writer_pending(&peer->tx) - before;
+    return flush_or_defer(peer);
+}
+
+// Completion of a send from peer_flush_queued, handled once the whole batch is in
+static void on_send_done(void *ctx, uint64_t tag, int res) {
+    struct peer **batch = ctx;
+    batch[tag]->send_res = res;
+}
+
+// Adds a round's quantum to the peer's deficit, capped so an idle stretch is no credit
+static size_t send_allowance(struct peer *peer, uint64_t now) {
+    if (!paced) {
+        return SIZE_MAX;
+    }
+    if (peer->deficit < 4 * PEER_QUANTUM) {
+        peer->deficit += PEER_QUANTUM;
+    }
+    size_t allowance = peer->deficit;
+    size_t tokens = bucket_available(&up_all, now);
+    if (tokens < allowance) {
+        allowance = tokens;
+    }
+    tokens = bucket_available(&peer->up, now);
+    return tokens < allowance ? tokens : allowance;
+}
+
+static void charge_send(struct peer *peer, size_t len) {
+    if (!paced) {
+        return;
+    }
+    peer->deficit -= len < peer->deficit ? len : peer->deficit;
+    bucket_take(&up_all, len);
+    bucket_take(&peer->up, len);
+}
+
+static void refund_send(struct peer *peer, size_t len) {
+    if (!paced) {
+        return;
+    }
+    peer->deficit += len;
+    bucket_return(&up_all, len);
+    bucket_return(&peer->up, len);
+}
+
+// Output the limits held back waits for the next round, after the peers still to be served
+static void park(struct peer *peer) {
+    peer->flush_queued = 1;
+    append_flush(&parked, &parked_tail, peer);
+}
+
+// Acts on a send result, whatever the send left behind goes out the usual way
+static void finish_send(struct peer *peer) {
+    int res = peer->send_res;
+    if (peer->closed) {
+        return;
+    }
+    refund_send(peer, res > 0 ? peer->send_len - res : peer->send_len);
+    if (res == -EAGAIN) {
+        // EPOLLOUT picks up where this left off
+        return;
+    }
+    if (res < 0) {
+        fprintf(stderr, "send to %s:%d: %s\n", peer->ip, peer->port, strerror(-res));
+        send_failed(peer);
+        return;
+    }
+    pkt_writer_consume(&peer->tx, res);
+    note_written(peer, res);
+    if (paced) {
+        if ((size_t)res == peer->send_len && pkt_writer_pending(&peer->tx) > 0) {
+            park(peer);
+        }
+    } else if (flush_peer(peer, SIZE_MAX, NULL) < 0) {
+        send_failed(peer);
+        return;
+    }
+    drained(peer);
+}
+
+/*
+ * Sends the buffered output of every peer written to since the last call.
+ * Run by the reactor after each batch of events.
+ *
+ * With io_uring, up to URING_ENTRIES peers go out per submission. Results
+ * are only acted on once the whole submission has completed, since acting
+ * on one can queue output for a peer whose send is still in flight. File
+ * segments go through pkt_writer_flush_some.
+ *
+ * With an upload limit each call is one round of deficit round robin: a
+ * peer earns PEER_QUANTUM bytes of credit and sends what that credit, its
+ * own bucket and the global bucket allow. Peers with output left wait for
+ * the next round behind the rest, and when the global bucket runs dry the
+ * peers not yet served lead the next round, which the pacing timer starts
+ * if nothing else does.
+ */
+void peer_flush_queued() {
+    uint64_t now = reactor_now_ms();
+    struct peer *batch[URING_ENTRIES];
+    while (flush_list && !(paced && bucket_available(&up_all, now) == 0)) {
+        int count = 0;
+        while (flush_list && count < URING_ENTRIES) {
+            if (paced && bucket_available(&up_all, now) == 0) {
                 break;
             }
-            peer = peer->next;
+            struct peer *peer = flush_list;
+            flush_list = peer->flush_next;
+            if (!flush_list) {
+                flush_tail = NULL;
+            }
+            peer->flush_queued = 0;
+            if (peer->closed || pkt_writer_pending(&peer->tx) == 0) {
+                peer->deficit = 0;
+                continue;
+            }
+
+            size_t allowance = send_allowance(peer, now);
+            uint8_t *data;
+            size_t len = pkt_writer_inline(&peer->tx, &data);
+            len = len < allowance ? len : allowance;
+            int flags = MSG_NOSIGNAL | MSG_DONTWAIT | (len < pkt_writer_pending(&peer->tx) ? MSG_MORE : 0);
+            if (uring_enabled() && len > 0 && uring_queue_send(peer->socket, data, len, flags, count) == 0) {
+                charge_send(peer, len);
+                peer->send_len = len;
+                peer->send_res = -ECANCELED;
+                batch[count++] = peer;
+                continue;
+            }
+
+            // A file segment comes first, or there is no ring
+            size_t sent = 0;
+            int rc = flush_peer(peer, allowance, &sent);
+            charge_send(peer, sent);
+            if (rc < 0) {
+                send_failed(peer);
+                continue;
+            } else if (rc > 0 && sent == allowance) {
+                // Stopped by the limits rather than the socket
+                park(peer);
+            }
+            drained(peer);
         }
-    } else if (result < 0) {
-        perror("recv");
+
+        if (count > 0 && uring_submit_wait(on_send_done, batch) < 0) {
+            // Peers whose send never completed are in an unknown state and get dropped
+            fprintf(stderr, "io_uring failed, falling back to epoll\n");
+            uring_shutdown();
+        }
+        for (int i = 0; i < count; i++) {
+            finish_send(batch[i]);
+        }
+    }
+
+    while (parked) {
+        struct peer *peer = parked;
+        parked = peer->flush_next;
+        append_flush(&flush_list, &flush_tail, peer);
+    }
+    parked_tail = NULL;
+}
+
+// HEL always travels in a fixed frame, carrying the newest framing we speak
+int peer_send_hello(struct peer *peer) {
+    struct btide_packet hello;
+    packet_init(&hello, PKT_MSG_HEL);
+    hello.pl.data[0] = PKT_FRAME_V1;
+    hello.pl.data[1] = PKT_FEAT_HAVE | PKT_FEAT_BATCH | PKT_FEAT_PING | PKT_FEAT_CHOKE | PKT_FEAT_CANCEL;
+    if (peer->local) {
+        hello.pl.data[1] |= PKT_FEAT_FDPASS;
+    }
+    hello.len = 2;
+    if (pkt_writer_queue(&peer->tx, &hello, PKT_FRAME_FIXED) < 0) {
+        return -1;
+    }
+    return pkt_writer_flush(&peer->tx, peer->socket) < 0 ? -1 : 0;
+}
+
+// Switches to the newest framing both sides support and notes the peer's features
+void peer_handle_hello(struct peer *peer, struct btide_packet *packet) {
+    if (packet->len >= 1 && packet_payload(packet)[0] >= PKT_FRAME_V1) {
+        peer->framing = PKT_FRAME_V1;
+    }
+    if (packet->len >= 2) {
+        peer->features = packet_payload(packet)[1];
+    }
+}
+
+/*
+ * PING carries the time it was queued as 8 bytes in network order, PONG
+ * echoes the payload back. The round trip is timed from when the PING
+ * actually reached the socket, which the stamp ties the PONG to.
+ */
+static void send_ping(struct peer *peer, uint64_t now) {
+    struct btide_packet ping;
+    packet_init(&ping, PKT_MSG_PNG);
+    uint32_t stamp[2] = { htonl((uint32_t)(now >> 32)), htonl((uint32_t)now) };
+    memcpy(ping.pl.data, stamp, 8);
+    ping.len = 8;
+    peer->ping_sent_ms = now;
+    peer->ping_wire_ms = 0;
+    if (peer_send(peer, &ping) == 0) {
+        peer->ping_ahead = pkt_writer_pending(&peer->tx);
+    }
+}
+
+static void handle_ping(struct peer *peer, struct btide_packet *packet) {
+    struct btide_packet pong;
+    packet_init(&pong, PKT_MSG_POG);
+    pong.len = packet->len < 8 ? packet->len : 8;
+    memcpy(pong.pl.data, packet_payload(packet), pong.len);
+    peer_send(peer, &pong);
+}
+
+// Smooths RTT like TCP and jitter like RFC 3550, from when the PING was written
+static void handle_pong(struct peer *peer, struct btide_packet *packet) {
+    if (packet->len < 8) {
+        return;
+    }
+    uint32_t stamp[2];
+    memcpy(stamp, packet_payload(packet), 8);
+    uint64_t sent = ((uint64_t)ntohl(stamp[0]) << 32) | ntohl(stamp[1]);
+    uint64_t now = reactor_now_ms();
+    if (sent != peer->ping_sent_ms || peer->ping_wire_ms == 0) {
+        // Echo of an older PING, or of one we never saw written
+        return;
+    }
+    sent = peer->ping_wire_ms;
+    if (sent > now) {
+        return;
+    }
+
+    double sample = (double)(now - sent);
+    if (peer->rtt_ms == 0) {
+        peer->rtt_ms = sample > 0 ? sample : 0.1;
+    } else {
+        double delta = sample > peer->last_rtt_ms ? sample - peer->last_rtt_ms : peer->last_rtt_ms - sample;
+        peer->jitter_ms += (delta - peer->jitter_ms) / 16;
+        peer->rtt_ms = 0.875 * peer->rtt_ms + 0.125 * sample;
+    }
+    peer->last_rtt_ms = sample;
+    inflight_set_path_rtt(&peer->inflight, peer->rtt_ms, peer->jitter_ms);
+}
+
+/*
+ * Pings peers that answer PING once per PEER_PING_INTERVAL_MS and drops
+ * one that has sent nothing at all for PEER_DEAD_MS. Returns -1 if the
+ * peer was removed.
+ */
+int peer_keepalive(struct peer *peer, uint64_t now) {
+    // In case the queue drained without an EPOLLOUT edge
+    resume_if_drained(peer);
+    if (peer->closed) {
+        return -1;
+    }
+    if (!(peer->features & PKT_FEAT_PING)) {
+        return 0;
+    }
+    if (now - peer->last_heard_ms >= PEER_DEAD_MS) {
+        // After a stall of our own the answer may be waiting unread
+        char byte;
+        if (recv(peer->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+            peer->last_heard_ms = now;
+            return 0;
+        }
+        printf("Peer %s:%d stopped responding.\n", peer->ip, peer->port);
+        remove_peer(peer);
+        return -1;
+    }
+    if (now - peer->ping_sent_ms >= PEER_PING_INTERVAL_MS) {
+        send_ping(peer, now);
+    }
+    return 0;
+}
+
+// Hands every complete frame in the input buffer to its handler
+static void dispatch_frames(struct peer *peer) {
+    struct btide_packet packet;
+    int rc = 0;
+    while (!peer->closed) {
+        // Frames left unread wait until the peer has taken our replies
+        if (backlog(peer) > queue_limit()) {
+            peer->throttled = 1;
+            break;
+        }
+        if ((rc = pkt_reader_next(&peer->rx, &packet)) != 1) {
+            break;
+        }
+        if (packet.msg_code == PKT_MSG_HEL) {
+            peer_handle_hello(peer, &packet);
+            // Let the application greet the peer once framing is settled
+            if (packet_handler) {
+                packet_handler(peer, &packet);
+            }
+        } else if (packet.msg_code == PKT_MSG_PNG && (peer->features & PKT_FEAT_PING)) {
+            handle_ping(peer, &packet);
+        } else if (packet.msg_code == PKT_MSG_POG && (peer->features & PKT_FEAT_PING)) {
+            handle_pong(peer, &packet);
+        } else if (packet.msg_code == PKT_MSG_DSN) {
+            if (packet.error == PKT_DSN_FULL) {
+                printf("Peer %s:%d is at its peer limit.\n", peer->ip, peer->port);
+            } else {
+                printf("Peer disconnected.\n");
+            }
+            // It left on purpose, there is no point in dialing it again
+            peer->redial = 0;
+            remove_peer(peer);
+        } else if (packet_handler) {
+            packet_handler(peer, &packet);
+        }
+    }
+    if (!peer->closed && rc < 0) {
+        fprintf(stderr, "Malformed packet from %s:%d\n", peer->ip, peer->port);
+        remove_peer(peer);
+    }
+}
+
+static void read_frames(struct peer *peer) {
+    while (!peer->closed && !peer->throttled) {
+        uint64_t now = reactor_now_ms();
+        if (bucket_available(&down_all, now) == 0 || bucket_available(&peer->down, now) == 0) {
+            // The pacing timer reads on once the buckets have refilled
+            peer->read_paused = 1;
+            peer->paused_ms = now;
+            break;
+        }
+        int n = pkt_reader_fill(&peer->rx, peer->socket);
+        if (n > 0) {
+            // A read can overshoot, the debt delays the next one
+            bucket_take(&down_all, n);
+            bucket_take(&peer->down, n);
+            peer->rx_bytes += n;
+            peer->last_heard_ms = now;
+            dispatch_frames(peer);
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        // Orderly close or a socket error
+        printf("Peer disconnected.\n");
+        remove_peer(peer);
+        break;
+    }
+}
+
+/*
+ * Hands the room that opened up in the output queue to the peer's jobs,
+ * then picks reading back up once the backlog is down to half the limit.
+ * Edge triggering will not report input that arrived while paused, so the
+ * socket is read until EAGAIN here.
+ */
+static void resume_if_drained(struct peer *peer) {
+    drained(peer);
+    if (!peer->closed && peer->throttled && backlog(peer) <= queue_limit() / 2) {
+        peer->throttled = 0;
+        dispatch_frames(peer);
+        read_frames(peer);
+    }
+}
+
+// Reactor callback for a peer socket, edge triggered so reads run until EAGAIN
+static void peer_on_event(void *ctx, uint32_t events) {
+    struct peer *peer = ctx;
+    if (peer->closed) {
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        if (paced) {
+            // The scheduler decides when the rest goes out
+            queue_flush(peer);
+        } else if (flush_peer(peer, SIZE_MAX, NULL) < 0) {
+            send_failed(peer);
+            return;
+        }
+        resume_if_drained(peer);
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        read_frames(peer);
+    }
+}
+
+// Resumes reading from peers that ran out of download tokens, sends resume after the batch
+static void on_pace(void *ctx, uint32_t events) {
+    struct peer *current = peer_list;
+    while (current) {
+        struct peer *next = current->next;
+        if (current->read_paused) {
+            // Answers waiting on our limit are not late
+            inflight_postpone(&current->inflight, reactor_now_ms() - current->paused_ms);
+            current->read_paused = 0;
+            read_frames(current);
+        }
+        current = next;
+    }
+}
+
+/*
+ * Sets up the global buckets from the config and has the reactor run
+ * peer_flush_queued after each batch of events. Any limit starts the
+ * pacing timer.
+ */
+int peer_rate_init() {
+    uint64_t now = reactor_now_ms();
+    bucket_init(&up_all, config.upload_kibps, now);
+    bucket_init(&down_all, config.download_kibps, now);
+    paced = config.upload_kibps > 0 || config.peer_upload_kibps > 0;
+    reactor_set_flush(peer_flush_queued);
+    if (!paced && config.download_kibps == 0 && config.peer_download_kibps == 0) {
+        return 0;
+    }
+    pace_handler.fn = on_pace;
+    return reactor_add_timer(&pace_handler, PEER_PACE_MS);
+}
+
+// Returns the availability record for a package, creating an unknown one
+struct peer_avail *peer_get_avail(struct peer *peer, const char *identifier, uint32_t nchunks) {
+    for (struct peer_avail *avail = peer->avail; avail; avail = avail->next) {
+        if (strcmp(avail->identifier, identifier) == 0) {
+            return avail;
+        }
+    }
+
+    struct peer_avail *avail = calloc(1, sizeof(struct peer_avail));
+    if (!avail) {
+        return NULL;
+    }
+    if (bitmap_init(&avail->have, nchunks) != 0 || bitmap_init(&avail->failed, nchunks) != 0) {
+        bitmap_destroy(&avail->have);
+        free(avail);
+        return NULL;
+    }
+    snprintf(avail->identifier, sizeof(avail->identifier), "%s", identifier);
+    avail->next = peer->avail;
+    peer->avail = avail;
+    return avail;
+}
+
+/*
+ * Peers that advertise hold only what their bitfields and HAVEs say, a
+ * package they never advertised they hold none of. Legacy peers may have
+ * any chunk they have not failed to serve.
+ */
+int peer_may_have(struct peer *peer, const char *identifier, uint32_t index) {
+    int advertises = (peer->features & PKT_FEAT_HAVE) != 0;
+    for (struct peer_avail *avail = peer->avail; avail; avail = avail->next) {
+        if (strcmp(avail->identifier, identifier) == 0) {
+            if (bitmap_test(&avail->failed, index)) {
+                return 0;
+            }
+            return avail->known ? bitmap_test(&avail->have, index) : !advertises;
+        }
+    }
+    return !advertises;
+}
+
+void peer_mark_failed(struct peer *peer, const char *identifier, uint32_t nchunks, uint32_t index) {
+    struct peer_avail *avail = peer_get_avail(peer, identifier, nchunks);
+    if (avail) {
+        bitmap_set(&avail->failed, index);
+    }
+}
+
+// Replaces what the peer holds of a package with its advertised bitfield
+void peer_set_bitfield(struct peer *peer, const char *identifier, uint32_t nchunks, const uint8_t *bits) {
+    struct peer_avail *avail = peer_get_avail(peer, identifier, nchunks);
+    if (!avail || avail->have.nbits != nchunks) {
+        return;
+    }
+    bitmap_import(&avail->have, bits);
+    avail->known = 1;
+}
+
+// Adds one chunk the peer has just verified
+void peer_set_have(struct peer *peer, const char *identifier, uint32_t nchunks, uint32_t index) {
+    struct peer_avail *avail = peer_get_avail(peer, identifier, nchunks);
+    if (!avail || index >= avail->have.nbits) {
+        return;
     }
+    bitmap_set(&avail->have, index);
+    // A chunk the peer could not serve before may be there now
+    bitmap_clear(&avail->failed, index);
+    avail->known = 1;
 }
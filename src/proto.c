@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include "../include/net/proto.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+// REQ payload is text: "<offset> <identifier> <chunk hash> <offset>"
+int req_encode(struct btide_packet *packet, const struct btide_req *req) {
+    packet_init(packet, PKT_MSG_REQ);
+    int len = snprintf((char *)packet->pl.data, sizeof(packet->pl.data), "%u %s %s %u",
+                       req->offset, req->identifier, req->chunk_hash, req->offset);
+    if (len < 0 || len >= (int)sizeof(packet->pl.data)) {
+        return -1;
+    }
+    packet->len = len + 1;
+    return 0;
+}
+
+int req_decode(struct btide_packet *packet, struct btide_req *req) {
+    char text[PAYLOAD_MAX + 1];
+    size_t len = packet->len < PAYLOAD_MAX ? packet->len : PAYLOAD_MAX;
+    memcpy(text, packet_payload(packet), len);
+    text[len] = '\0';
+
+    char *save = NULL;
+    char *offset = strtok_r(text, " ", &save);
+    char *identifier = strtok_r(NULL, " ", &save);
+    char *hash = strtok_r(NULL, " ", &save);
+    if (!offset || !identifier || !hash || strlen(identifier) > PROTO_IDENT_MAX ||
+        strlen(hash) != PROTO_HASH_LEN) {
+        return -1;
+    }
+
+    req->offset = strtoul(offset, NULL, 10);
+    strcpy(req->identifier, identifier);
+    strcpy(req->chunk_hash, hash);
+    req->chunk_index = -1;
+    return 0;
+}
+
+/*
+ * RES payload header, integers in network order:
+ *   offset (4) | data_len (4) | chunk hash (64) | ident_len (2) | identifier
+ * followed by data_len bytes of chunk data. Returns the header length.
+ */
+size_t res_header_encode(const struct btide_res *res, uint8_t *out) {
+    uint32_t offset = htonl(res->offset);
+    uint32_t data_len = htonl(res->data_len);
+    size_t ident_len = strnlen(res->identifier, PROTO_IDENT_MAX);
+    uint16_t wire_ident_len = htons((uint16_t)ident_len);
+
+    memcpy(out, &offset, 4);
+    memcpy(out + 4, &data_len, 4);
+    memcpy(out + 8, res->chunk_hash, PROTO_HASH_LEN);
+    memcpy(out + 8 + PROTO_HASH_LEN, &wire_ident_len, 2);
+    memcpy(out + RES_HDR_FIXED, res->identifier, ident_len);
+    return RES_HDR_FIXED + ident_len;
+}
+
+// Reads the header written by res_header_encode, returns its length or -1
+static int res_header_decode(const uint8_t *in, size_t len, struct btide_res *res) {
+    if (len < RES_HDR_FIXED) {
+        return -1;
+    }
+
+    uint32_t offset, data_len;
+    uint16_t ident_len;
+    memcpy(&offset, in, 4);
+    memcpy(&data_len, in + 4, 4);
+    memcpy(&ident_len, in + 8 + PROTO_HASH_LEN, 2);
+    res->offset = ntohl(offset);
+    res->data_len = ntohl(data_len);
+    ident_len = ntohs(ident_len);
+
+    if (ident_len > PROTO_IDENT_MAX || (size_t)RES_HDR_FIXED + ident_len > len) {
+        return -1;
+    }
+    memcpy(res->chunk_hash, in + 8, PROTO_HASH_LEN);
+    res->chunk_hash[PROTO_HASH_LEN] = '\0';
+    memcpy(res->identifier, in + RES_HDR_FIXED, ident_len);
+    res->identifier[ident_len] = '\0';
+    res->data = NULL;
+    return RES_HDR_FIXED + ident_len;
+}
+
+int res_decode(struct btide_packet *packet, struct btide_res *res) {
+    uint8_t *in = packet_payload(packet);
+    int hlen = res_header_decode(in, packet->len, res);
+    if (hlen < 0 || (size_t)hlen + res->data_len > packet->len) {
+        return -1;
+    }
+    res->data = in + hlen;
+    return 0;
+}
+
+/*
+ * RFD payload, sent with a read-only descriptor of the package's data file:
+ *   file offset (8) | RES header
+ * The data_len bytes of chunk data are read from the descriptor at the
+ * file offset instead of following the header. Returns the payload length.
+ */
+size_t rfd_encode(const struct btide_res *res, uint64_t file_offset, uint8_t *out) {
+    uint32_t hi = htonl((uint32_t)(file_offset >> 32));
+    uint32_t lo = htonl((uint32_t)file_offset);
+    memcpy(out, &hi, 4);
+    memcpy(out + 4, &lo, 4);
+    return 8 + res_header_encode(res, out + 8);
+}
+
+int rfd_decode(struct btide_packet *packet, struct btide_res *res, uint64_t *file_offset) {
+    uint8_t *in = packet_payload(packet);
+    if (packet->len < 8 || res_header_decode(in + 8, packet->len - 8, res) < 0) {
+        return -1;
+    }
+    uint32_t hi, lo;
+    memcpy(&hi, in, 4);
+    memcpy(&lo, in + 4, 4);
+    *file_offset = (uint64_t)ntohl(hi) << 32 | ntohl(lo);
+    return 0;
+}
+
+// Writes ident_len (2) | identifier, returns the bytes written
+static size_t ident_encode(const char *identifier, uint8_t *out) {
+    size_t ident_len = strnlen(identifier, PROTO_IDENT_MAX);
+    uint16_t wire_ident_len = htons((uint16_t)ident_len);
+    memcpy(out, &wire_ident_len, 2);
+    memcpy(out + 2, identifier, ident_len);
+    return 2 + ident_len;
+}
+
+// Reads ident_len (2) | identifier, returns the bytes consumed or 0 if short
+static size_t ident_decode(const uint8_t *in, size_t len, char *identifier) {
+    uint16_t ident_len;
+    if (len < 2) {
+        return 0;
+    }
+    memcpy(&ident_len, in, 2);
+    ident_len = ntohs(ident_len);
+    if (ident_len > PROTO_IDENT_MAX || (size_t)2 + ident_len > len) {
+        return 0;
+    }
+    memcpy(identifier, in + 2, ident_len);
+    identifier[ident_len] = '\0';
+    return 2 + ident_len;
+}
+
+/*
+ * BFD payload: ident_len (2) | identifier | nchunks (4) | bitmap, the bitmap
+ * taking (nchunks + 7) / 8 bytes. out needs room for all of it.
+ */
+size_t bitfield_encode(const char *identifier, uint32_t nchunks, const uint8_t *bits, uint8_t *out) {
+    size_t pos = ident_encode(identifier, out);
+    uint32_t wire_nchunks = htonl(nchunks);
+    memcpy(out + pos, &wire_nchunks, 4);
+    pos += 4;
+    memcpy(out + pos, bits, (nchunks + 7) / 8);
+    return pos + (nchunks + 7) / 8;
+}
+
+int bitfield_decode(struct btide_packet *packet, struct btide_bitfield *bitfield) {
+    uint8_t *in = packet_payload(packet);
+    size_t pos = ident_decode(in, packet->len, bitfield->identifier);
+    uint32_t nchunks;
+    if (pos == 0 || pos + 4 > packet->len) {
+        return -1;
+    }
+    memcpy(&nchunks, in + pos, 4);
+    bitfield->nchunks = ntohl(nchunks);
+    pos += 4;
+    if ((packet->len - pos) < ((uint64_t)bitfield->nchunks + 7) / 8) {
+        return -1;
+    }
+    bitfield->bits = in + pos;
+    return 0;
+}
+
+/*
+ * BRQ payload: ident_len (2) | identifier | count (2) followed by count
+ * ranges of chunk index (4) | offset (4) | len (4), all in network order.
+ * CAN uses the same layout, only the chunk indexes matter.
+ */
+size_t batch_encode(const struct btide_batch *batch, uint8_t *out) {
+    size_t pos = ident_encode(batch->identifier, out);
+    uint16_t count = htons((uint16_t)batch->count);
+    memcpy(out + pos, &count, 2);
+    pos += 2;
+    for (int i = 0; i < batch->count; i++) {
+        uint32_t fields[3] = {
+            htonl(batch->ranges[i].index), htonl(batch->ranges[i].offset), htonl(batch->ranges[i].len)
+        };
+        memcpy(out + pos, fields, BRQ_RANGE_SIZE);
+        pos += BRQ_RANGE_SIZE;
+    }
+    return pos;
+}
+
+int batch_decode(struct btide_packet *packet, struct btide_batch *batch) {
+    uint8_t *in = packet_payload(packet);
+    size_t pos = ident_decode(in, packet->len, batch->identifier);
+    uint16_t count;
+    if (pos == 0 || pos + 2 > packet->len) {
+        return -1;
+    }
+    memcpy(&count, in + pos, 2);
+    count = ntohs(count);
+    pos += 2;
+    if (count > BRQ_RANGES_MAX || pos + (size_t)count * BRQ_RANGE_SIZE > packet->len) {
+        return -1;
+    }
+
+    batch->count = count;
+    for (int i = 0; i < count; i++) {
+        uint32_t fields[3];
+        memcpy(fields, in + pos, BRQ_RANGE_SIZE);
+        batch->ranges[i].index = ntohl(fields[0]);
+        batch->ranges[i].offset = ntohl(fields[1]);
+        batch->ranges[i].len = ntohl(fields[2]);
+        pos += BRQ_RANGE_SIZE;
+    }
+    return 0;
+}
+
+// HAV payload: ident_len (2) | identifier | chunk index (4)
+size_t have_encode(const struct btide_have *have, uint8_t *out) {
+    size_t pos = ident_encode(have->identifier, out);
+    uint32_t index = htonl(have->index);
+    memcpy(out + pos, &index, 4);
+    return pos + 4;
+}
+
+int have_decode(struct btide_packet *packet, struct btide_have *have) {
+    uint8_t *in = packet_payload(packet);
+    size_t pos = ident_decode(in, packet->len, have->identifier);
+    uint32_t index;
+    if (pos == 0 || pos + 4 > packet->len) {
+        return -1;
+    }
+    memcpy(&index, in + pos, 4);
+    have->index = ntohl(index);
+    return 0;
+}
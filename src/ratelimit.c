@@ -0,0 +1,47 @@
+#include "../include/net/ratelimit.h"
+
+// Starts a bucket full, kibps of 0 leaves it unlimited
+void bucket_init(struct token_bucket *bucket, int kibps, uint64_t now) {
+    bucket->rate = kibps > 0 ? kibps * 1024.0 / 1000.0 : 0;
+    bucket->burst = bucket->rate * RATE_BURST_MS;
+    if (bucket->burst < RATE_BURST_MIN) {
+        bucket->burst = RATE_BURST_MIN;
+    }
+    bucket->tokens = bucket->burst;
+    bucket->last_ms = now;
+}
+
+int bucket_limited(const struct token_bucket *bucket) {
+    return bucket->rate > 0;
+}
+
+// Bytes that may be moved now, SIZE_MAX for an unlimited bucket
+size_t bucket_available(struct token_bucket *bucket, uint64_t now) {
+    if (!bucket_limited(bucket)) {
+        return SIZE_MAX;
+    }
+    if (now > bucket->last_ms) {
+        bucket->tokens += bucket->rate * (double)(now - bucket->last_ms);
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+        bucket->last_ms = now;
+    }
+    return bucket->tokens >= 1 ? (size_t)bucket->tokens : 0;
+}
+
+void bucket_take(struct token_bucket *bucket, size_t len) {
+    if (bucket_limited(bucket)) {
+        bucket->tokens -= (double)len;
+    }
+}
+
+// Gives back tokens taken for bytes that were never sent
+void bucket_return(struct token_bucket *bucket, size_t len) {
+    if (bucket_limited(bucket)) {
+        bucket->tokens += (double)len;
+        if (bucket->tokens > bucket->burst) {
+            bucket->tokens = bucket->burst;
+        }
+    }
+}
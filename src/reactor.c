@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include "../include/net/reactor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+
+struct deferred {
+    void *ptr;
+    void (*release)(void *);
+    struct deferred *next;
+};
+
+static int epoll_fd = -1;
+static int running = 0;
+static struct deferred *deferred_list = NULL;
+static void (*flush_fn)() = NULL;
+
+int reactor_init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to watch a descriptor, the handler must outlive its registration
+int reactor_add(struct reactor_handler *handler, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = handler };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handler->fd, &ev) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int reactor_mod(struct reactor_handler *handler, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = handler };
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, handler->fd, &ev);
+}
+
+void reactor_del(struct reactor_handler *handler) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+// Function to create a periodic timer that fires handler->fn
+int reactor_add_timer(struct reactor_handler *handler, int interval_ms) {
+    handler->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (handler->fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    handler->timer = 1;
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(handler->fd, 0, &spec, NULL) < 0 || reactor_add(handler, EPOLLIN) < 0) {
+        perror("timerfd_settime");
+        close(handler->fd);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Frees ptr once the current batch of events has been dispatched, so a
+ * handler can drop an object another pending event still points at.
+ */
+void reactor_defer_free(void *ptr, void (*release)(void *)) {
+    struct deferred *d = malloc(sizeof(struct deferred));
+    if (!d) {
+        // Leaking is safer than a use after free
+        return;
+    }
+    d->ptr = ptr;
+    d->release = release;
+    d->next = deferred_list;
+    deferred_list = d;
+}
+
+static void run_deferred() {
+    while (deferred_list) {
+        struct deferred *d = deferred_list;
+        deferred_list = d->next;
+        d->release(d->ptr);
+        free(d);
+    }
+}
+
+// Function to set what runs after each batch of events, before deferred frees
+void reactor_set_flush(void (*flush)()) {
+    flush_fn = flush;
+}
+
+// Main loop, dispatches ready descriptors until reactor_stop is called
+void reactor_run() {
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    running = 1;
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct reactor_handler *handler = events[i].data.ptr;
+            if (handler->timer) {
+                uint64_t expirations;
+                if (read(handler->fd, &expirations, sizeof(expirations)) < 0) {
+                    continue;
+                }
+            }
+            handler->fn(handler->ctx, events[i].events);
+        }
+        if (flush_fn) {
+            flush_fn();
+        }
+        run_deferred();
+    }
+}
+
+void reactor_stop() {
+    running = 0;
+}
+
+// Monotonic milliseconds, for timeouts and RTT measurement
+uint64_t reactor_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
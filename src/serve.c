@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include "../include/pkg/serve.h"
+#include "../include/net/uring.h"
+#include "../include/pkg/cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Answers a request that cannot be served so the peer does not wait on it.
+ * An empty hash tells the peer the whole package cannot be served.
+ */
+static int send_error(struct peer *peer, const char *identifier, const char *hash, uint32_t offset,
+                      uint16_t error) {
+    struct btide_res res = { .offset = offset, .data_len = 0 };
+    snprintf(res.chunk_hash, sizeof(res.chunk_hash), "%s", hash);
+    snprintf(res.identifier, sizeof(res.identifier), "%s", identifier);
+
+    struct btide_packet packet;
+    packet_init(&packet, PKT_MSG_RES);
+    packet.error = error;
+    packet.len = res_header_encode(&res, packet.pl.data);
+    return peer_send(peer, &packet);
+}
+
+static void on_read_done(void *ctx, uint64_t tag, int res) {
+    int *results = ctx;
+    results[tag] = res;
+}
+
+/*
+ * Fixed-frame RES frames through io_uring: each frame is built in a
+ * registered buffer, header first, and the data for up to URING_NBUFS
+ * frames is read into them with one submission instead of one pread each.
+ * The reactor still waits for the reads, so this saves syscalls, not
+ * time blocked on the disk. V1 peers keep sendfile instead, which already
+ * reads a whole range in few calls without copying it.
+ * Returns 1 if the ring failed, the ring is shut down and *pos is where
+ * the caller carries on without it.
+ */
+static int serve_range_uring(struct peer *peer, struct package *pkg, int index, uint32_t *pos, uint32_t end,
+                             int fd) {
+    struct chunk *chk = &pkg->chunks[index];
+    struct btide_res res = { 0 };
+    strcpy(res.chunk_hash, chk->hash);
+    snprintf(res.identifier, sizeof(res.identifier), "%s", pkg->identifier);
+
+    size_t room = PAYLOAD_MAX - RES_HDR_MAX;
+    size_t hlen[URING_NBUFS];
+    uint32_t data_len[URING_NBUFS];
+    int results[URING_NBUFS];
+    while (*pos < end) {
+        int nframes = 0;
+        uint32_t at = *pos;
+        while (nframes < URING_NBUFS && at < end) {
+            res.offset = at;
+            res.data_len = end - at < room ? end - at : room;
+            hlen[nframes] = res_header_encode(&res, uring_buffer(nframes));
+            data_len[nframes] = res.data_len;
+            if (uring_queue_read_fixed(fd, nframes, hlen[nframes], res.data_len, (off_t)chk->offset + at,
+                                       nframes) < 0) {
+                break;
+            }
+            at += res.data_len;
+            nframes++;
+        }
+        if (nframes == 0 || uring_submit_wait(on_read_done, results) < 0) {
+            // Reads left in the ring are in an unknown state, pread takes over
+            fprintf(stderr, "io_uring failed, falling back to pread\n");
+            uring_shutdown();
+            return 1;
+        }
+
+        for (int i = 0; i < nframes; i++) {
+            if (results[i] != (int)data_len[i]) {
+                return send_error(peer, pkg->identifier, chk->hash, *pos, 1);
+            }
+            struct btide_packet packet;
+            packet_init(&packet, PKT_MSG_RES);
+            packet.body = uring_buffer(i);
+            packet.len = hlen[i] + data_len[i];
+            if (peer_send(peer, &packet) < 0) {
+                return -1;
+            }
+            *pos += data_len[i];
+        }
+    }
+    return 0;
+}
+
+// Frames a range of a cached chunk for a fixed-frame peer, its bytes go from the cache straight into the output queue
+static int serve_cached(struct peer *peer, struct package *pkg, int index, uint32_t pos, uint32_t end,
+                        const uint8_t *data) {
+    struct chunk *chk = &pkg->chunks[index];
+    struct btide_res res = { 0 };
+    strcpy(res.chunk_hash, chk->hash);
+    snprintf(res.identifier, sizeof(res.identifier), "%s", pkg->identifier);
+
+    uint8_t header[RES_HDR_MAX];
+    size_t room = PAYLOAD_MAX - RES_HDR_MAX;
+    while (pos < end) {
+        struct btide_packet packet;
+        packet_init(&packet, PKT_MSG_RES);
+        res.offset = pos;
+        res.data_len = end - pos < room ? end - pos : room;
+        size_t hlen = res_header_encode(&res, header);
+        packet.body = header;
+        packet.len = hlen + res.data_len;
+        if (peer_send_parts(peer, &packet, hlen, data + pos) < 0) {
+            return -1;
+        }
+        pos += res.data_len;
+    }
+    return 0;
+}
+
+/*
+ * Answers a local peer with RFDs carrying a read-only descriptor of the
+ * data file, one per PKT_BODY_MAX like RES. The peer reads the range
+ * itself and no chunk bytes cross the socket.
+ */
+static int serve_fd(struct peer *peer, struct package *pkg, int index, uint32_t offset, uint32_t end) {
+    struct chunk *chk = &pkg->chunks[index];
+    int fd = package_read_fd(pkg);
+    if (fd < 0) {
+        return send_error(peer, pkg->identifier, chk->hash, offset, 1);
+    }
+
+    struct btide_res res = { 0 };
+    strcpy(res.chunk_hash, chk->hash);
+    snprintf(res.identifier, sizeof(res.identifier), "%s", pkg->identifier);
+
+    uint32_t pos = offset;
+    while (pos < end) {
+        struct btide_packet packet;
+        packet_init(&packet, PKT_MSG_RFD);
+        res.offset = pos;
+        res.data_len = end - pos < PKT_BODY_MAX ? end - pos : PKT_BODY_MAX;
+        packet.len = rfd_encode(&res, (uint64_t)chk->offset + pos, packet.pl.data);
+        if (peer_send_fd(peer, &packet, fd) < 0) {
+            return -1;
+        }
+        pos += res.data_len;
+    }
+    return 0;
+}
+
+/*
+ * Streams bytes offset to end of a chunk. Peers speaking length-prefixed
+ * frames get one RES per PKT_BODY_MAX whose data goes from the data file
+ * to the socket with sendfile, fixed-frame peers get the range copied
+ * through as many 4096-byte RES frames as it needs, from the chunk cache
+ * when it holds the chunk or can take it. Only the copying path uses the
+ * cache, sendfile needs no copy of its own. Local peers that can take a
+ * descriptor get an RFD instead.
+ */
+static int serve_range(struct peer *peer, struct package *pkg, int index, uint32_t offset, uint32_t end) {
+    struct chunk *chk = &pkg->chunks[index];
+    if (peer->local && (peer->features & PKT_FEAT_FDPASS)) {
+        return serve_fd(peer, pkg, index, offset, end);
+    }
+
+    int fd = package_data_fd(pkg);
+    if (fd < 0) {
+        return send_error(peer, pkg->identifier, chk->hash, offset, 1);
+    }
+
+    int rc = 0;
+    if (peer->framing != PKT_FRAME_V1) {
+        const uint8_t *cached;
+        rc = cache_get(chk->hash, fd, (off_t)chk->offset, chk->size, &cached);
+        if (rc < 0) {
+            return send_error(peer, pkg->identifier, chk->hash, offset, 1);
+        }
+        if (rc > 0) {
+            return serve_cached(peer, pkg, index, offset, end, cached);
+        }
+    }
+
+    if (peer->framing != PKT_FRAME_V1 && uring_enabled()) {
+        rc = serve_range_uring(peer, pkg, index, &offset, end, fd);
+        if (rc <= 0) {
+            return rc;
+        }
+    }
+
+    struct btide_res res = { 0 };
+    strcpy(res.chunk_hash, chk->hash);
+    snprintf(res.identifier, sizeof(res.identifier), "%s", pkg->identifier);
+
+    uint8_t header[RES_HDR_MAX];
+    uint32_t pos = offset;
+    while (pos < end) {
+        struct btide_packet packet;
+        packet_init(&packet, PKT_MSG_RES);
+        res.offset = pos;
+
+        if (peer->framing == PKT_FRAME_V1) {
+            size_t room = PKT_BODY_MAX - RES_HDR_MAX;
+            res.data_len = end - pos < room ? end - pos : room;
+            size_t hlen = res_header_encode(&res, header);
+            packet.body = header;
+            packet.len = hlen + res.data_len;
+            if (peer_send_file(peer, &packet, hlen, fd, (off_t)chk->offset + pos) < 0) {
+                return -1;
+            }
+        } else {
+            size_t room = PAYLOAD_MAX - RES_HDR_MAX;
+            res.data_len = end - pos < room ? end - pos : room;
+            size_t hlen = res_header_encode(&res, packet.pl.data);
+            ssize_t n = pread(fd, packet.pl.data + hlen, res.data_len, (off_t)chk->offset + pos);
+            if (n != (ssize_t)res.data_len) {
+                return send_error(peer, pkg->identifier, chk->hash, pos, 1);
+            }
+            packet.len = hlen + res.data_len;
+            if (peer_send(peer, &packet) < 0) {
+                return -1;
+            }
+        }
+        pos += res.data_len;
+    }
+    return 0;
+}
+
+// Adds a range to the peer's jobs, it is read and framed once its turn comes
+static int queue_job(struct peer *peer, struct package *pkg, int index, uint32_t offset, uint32_t end) {
+    struct serve_job *job = malloc(sizeof(struct serve_job));
+    if (!job) {
+        return send_error(peer, pkg->identifier, pkg->chunks[index].hash, offset, 1);
+    }
+    snprintf(job->identifier, sizeof(job->identifier), "%s", pkg->identifier);
+    job->index = index;
+    job->offset = offset;
+    job->end = end;
+    job->next = NULL;
+    if (peer->jobs_tail) {
+        peer->jobs_tail->next = job;
+    } else {
+        peer->jobs = job;
+    }
+    peer->jobs_tail = job;
+    peer->job_bytes += end - offset;
+    return 0;
+}
+
+/*
+ * Frames the peer's jobs in order until SERVE_QUEUE_BYTES of output are
+ * waiting, the rest wait for the queue to drain. A package removed in the
+ * meantime is reported as one that cannot be served.
+ */
+void serve_pump(struct peer *peer) {
+    while (peer->jobs && !peer->closed && pkt_writer_pending(&peer->tx) < SERVE_QUEUE_BYTES) {
+        struct serve_job *job = peer->jobs;
+        peer->jobs = job->next;
+        if (!peer->jobs) {
+            peer->jobs_tail = NULL;
+        }
+        peer->job_bytes -= job->end - job->offset;
+
+        struct package *pkg = find_package_exact(job->identifier);
+        if (!pkg || job->index >= pkg->nchunks) {
+            send_error(peer, job->identifier, "", 0, 1);
+        } else {
+            serve_range(peer, pkg, job->index, job->offset, job->end);
+        }
+        free(job);
+    }
+}
+
+// Serves a text REQ, from its offset to the end of the chunk
+int serve_request(struct peer *peer, struct btide_req *req) {
+    struct package *pkg = find_package_exact(req->identifier);
+    if (!pkg) {
+        return send_error(peer, req->identifier, req->chunk_hash, req->offset, 1);
+    }
+
+    int index = package_find_chunk(pkg, req->chunk_hash);
+    if (index < 0 || !package_has_chunk(pkg, index) || req->offset >= pkg->chunks[index].size) {
+        return send_error(peer, req->identifier, req->chunk_hash, req->offset, 1);
+    }
+    if (queue_job(peer, pkg, index, req->offset, pkg->chunks[index].size) < 0) {
+        return -1;
+    }
+    serve_pump(peer);
+    return 0;
+}
+
+/*
+ * Queues every range of a BRQ back to back, so the peer sees one
+ * continuous stream. Ranges that cannot be served are answered at once.
+ */
+int serve_batch(struct peer *peer, struct btide_batch *batch) {
+    struct package *pkg = find_package_exact(batch->identifier);
+    if (!pkg) {
+        return send_error(peer, batch->identifier, "", 0, 1);
+    }
+
+    for (int i = 0; i < batch->count && !peer->closed; i++) {
+        struct btide_range *range = &batch->ranges[i];
+        if (range->index >= (uint32_t)pkg->nchunks) {
+            // The peer's package does not match ours
+            return send_error(peer, batch->identifier, "", 0, 1);
+        }
+
+        struct chunk *chk = &pkg->chunks[range->index];
+        uint32_t end = range->len ? range->offset + range->len : chk->size;
+        if (!package_has_chunk(pkg, range->index) || range->offset >= chk->size ||
+            end > chk->size || end <= range->offset) {
+            if (send_error(peer, pkg->identifier, chk->hash, range->offset, 1) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (queue_job(peer, pkg, range->index, range->offset, end) < 0) {
+            return -1;
+        }
+    }
+    serve_pump(peer);
+    return 0;
+}
+
+// Drops the jobs overlapping a range named in a CAN, output already queued still goes out
+void serve_cancel(struct peer *peer, struct btide_batch *batch) {
+    struct serve_job **link = &peer->jobs;
+    peer->jobs_tail = NULL;
+    while (*link) {
+        struct serve_job *job = *link;
+        int cancelled = 0;
+        for (int i = 0; i < batch->count && !cancelled; i++) {
+            struct btide_range *range = &batch->ranges[i];
+            cancelled = job->index == (int)range->index && job->offset < (uint64_t)range->offset + range->len &&
+                        range->offset < job->end && strcmp(job->identifier, batch->identifier) == 0;
+        }
+        if (cancelled) {
+            *link = job->next;
+            peer->job_bytes -= job->end - job->offset;
+            free(job);
+        } else {
+            peer->jobs_tail = job;
+            link = &job->next;
+        }
+    }
+}
+
+// Sends the completion bitmap of one package, empty packages are not advertised
+static int send_bitfield(struct peer *peer, struct package *pkg) {
+    if (!(peer->features & PKT_FEAT_HAVE) || peer->framing != PKT_FRAME_V1 || atomic_load(&pkg->completed_chunks) == 0) {
+        return 0;
+    }
+
+    size_t nbytes = bitmap_bytes(pkg->nchunks);
+    uint8_t *bits = malloc(nbytes);
+    uint8_t *body = malloc(2 + PROTO_IDENT_MAX + 4 + nbytes);
+    if (!bits || !body) {
+        free(bits);
+        free(body);
+        return -1;
+    }
+    bitmap_export(&pkg->have, bits);
+
+    struct btide_packet packet;
+    packet_init(&packet, PKT_MSG_BFD);
+    packet.len = bitfield_encode(pkg->identifier, pkg->nchunks, bits, body);
+    packet.body = body;
+    int rc = peer_send(peer, &packet);
+    free(bits);
+    free(body);
+    return rc;
+}
+
+// Tells a peer that has just greeted us which chunks we can serve
+int serve_advertise(struct peer *peer) {
+    for (struct package *pkg = get_package_list(); pkg; pkg = pkg->next) {
+        if (send_bitfield(peer, pkg) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Advertises a newly added package to every connected peer
+void serve_advertise_package(struct package *pkg) {
+    struct peer *peer = get_peer_list();
+    while (peer) {
+        struct peer *next = peer->next;
+        send_bitfield(peer, pkg);
+        peer = next;
+    }
+}
+
+// Sends HAVE for a chunk that has just been verified
+void serve_announce_chunk(struct package *pkg, int index) {
+    struct btide_have have = { .index = index };
+    snprintf(have.identifier, sizeof(have.identifier), "%s", pkg->identifier);
+
+    struct peer *peer = get_peer_list();
+    while (peer) {
+        struct peer *next = peer->next;
+        if (peer->features & PKT_FEAT_HAVE) {
+            struct btide_packet packet;
+            packet_init(&packet, PKT_MSG_HAV);
+            packet.len = have_encode(&have, packet.pl.data);
+            peer_send(peer, &packet);
+        }
+        peer = next;
+    }
+}
@@ -0,0 +1,869 @@
+#define _GNU_SOURCE
+#include "../include/peer/udp.h"
+#include "../include/peer/dial.h"
+#include "../include/config/config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+/*
+ * Peers reached over UDP. The peer layer is unchanged: each connection
+ * hands the peer one end of a socketpair and carries the frames written
+ * to it as datagrams, and the frames received back are written to it
+ * whole.
+ *
+ * Frames are laid on streams. Control messages share stream 0 and each
+ * RES gets a stream of its own, so a lost datagram holds up only the
+ * frame it belongs to and other responses are delivered as soon as they
+ * are complete. The sender hands stream ids out in turn and takes one
+ * back once all its bytes are acknowledged. The receiver keeps the state
+ * of any stream it sees, so a reused id simply continues at its offset. Every datagram has a packet number of its
+ * own, retransmissions included. The receiver answers each batch of
+ * datagrams with an ACK listing the ranges of packet numbers it holds.
+ * The sender counts a packet as lost once it lies in a gap under a
+ * reported range and UDP_REORDER later ones are acknowledged, or once a
+ * later one is acknowledged and the packet is an eighth of an RTT past
+ * its own round trip, or all of them once the retransmission timeout
+ * passes. A packet below the lowest reported range may be one whose range
+ * was dropped to make room, so only the time rule applies to it.
+ * Lost bytes go out again under a new number before any new bytes.
+ *
+ * Congestion control is NewReno-like: the window grows by the acknowledged
+ * bytes in slow start and by one segment per window after, and is halved
+ * once per window of data that saw a loss. A timeout drops it to two
+ * segments.
+ *
+ * udp_loss_percent drops that share of arriving datagrams, so recovery
+ * can be exercised over loopback.
+ */
+struct udp_buf {
+    uint8_t *data;
+    size_t start;
+    size_t end;
+    size_t cap;
+};
+
+struct udp_seg {
+    uint32_t pkt;           // Packet number of the latest transmission
+    uint16_t stream;
+    uint16_t len;
+    uint64_t offset;        // Position of the bytes within their stream
+    uint64_t sent_ms;
+    struct udp_seg *next;
+    uint8_t data[UDP_SEG_MAX];
+};
+
+struct udp_stream {
+    uint64_t send_offset;   // Bytes sent on the stream so far
+    int unacked;            // Segments cut for the stream and not yet acknowledged
+    uint64_t recv_offset;   // Bytes received in order
+    struct udp_seg *ooo;    // Received past recv_offset, by offset
+    struct udp_buf frame;   // In-order bytes of a frame not yet complete
+};
+
+struct udp_range {
+    uint32_t hi;
+    uint32_t lo;
+};
+
+struct udp_conn {
+    struct sockaddr_in addr;
+    char ip[INET_ADDRSTRLEN];
+    int port;
+    uint32_t id;                // Chosen by the side that connected
+    int sock;                   // Our end of the socketpair, the peer holds the other
+    struct reactor_handler handler;
+    int established;            // The other side has answered
+    int closing;                // The peer let go of its end, the rest is sent before closing
+    int rejected;               // Over max_peers, carries only our DSN and ignores what arrives
+    struct udp_stream *streams[UDP_STREAMS];
+
+    struct udp_buf in;          // Frames from the peer not yet cut into segments
+    int cut_stream;             // Stream of the frame being cut
+    int next_stream;            // Where the search for a free RES stream starts
+    size_t cut_left;            // Bytes of that frame still to cut
+    struct udp_seg *retx;       // Lost segments, sent before new ones
+    struct udp_seg *retx_tail;
+    struct udp_seg *flight;     // Sent and not acknowledged, by packet number
+    struct udp_seg *flight_tail;
+    size_t flight_bytes;
+    uint32_t next_pkt;
+    uint32_t recovery_pkt;      // Losses up to this packet belong to the last congestion event
+    double cwnd;
+    double ssthresh;
+    double srtt;
+    double rttvar;
+    uint64_t rto_ms;
+    uint64_t last_ack_ms;
+
+    struct udp_range ranges[UDP_ACK_RANGES];  // Received packet numbers, highest first
+    int nranges;
+    int ack_pending;
+    struct udp_buf out;         // Whole frames for the peer
+    struct udp_conn *next;
+};
+
+extern Config config;
+static int udp_socket = -1;
+static struct reactor_handler udp_handler;
+static struct reactor_handler timer_handler;
+static struct udp_conn *conns = NULL;
+
+static void put16(uint8_t *p, uint16_t v) {
+    v = htons(v);
+    memcpy(p, &v, 2);
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, 4);
+}
+
+static uint16_t get16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, 2);
+    return ntohs(v);
+}
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+static size_t buf_len(struct udp_buf *buf) {
+    return buf->end - buf->start;
+}
+
+// Makes room for len more bytes at the end
+static int buf_reserve(struct udp_buf *buf, size_t len) {
+    if (buf->start > 0 && (buf->start == buf->end || buf->end + len > buf->cap)) {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+    }
+    if (buf->end + len <= buf->cap) {
+        return 0;
+    }
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->end + len) {
+        cap *= 2;
+    }
+    uint8_t *data = realloc(buf->data, cap);
+    if (!data) {
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+static int buf_append(struct udp_buf *buf, const uint8_t *data, size_t len) {
+    if (buf_reserve(buf, len) < 0) {
+        return -1;
+    }
+    memcpy(buf->data + buf->end, data, len);
+    buf->end += len;
+    return 0;
+}
+
+static void free_segs(struct udp_seg *seg) {
+    while (seg) {
+        struct udp_seg *next = seg->next;
+        free(seg);
+        seg = next;
+    }
+}
+
+static void free_conn(void *ptr) {
+    struct udp_conn *conn = ptr;
+    for (int i = 0; i < UDP_STREAMS; i++) {
+        if (conn->streams[i]) {
+            free_segs(conn->streams[i]->ooo);
+            free(conn->streams[i]->frame.data);
+            free(conn->streams[i]);
+        }
+    }
+    free_segs(conn->retx);
+    free_segs(conn->flight);
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn);
+}
+
+// Closing our end shows the peer an orderly close, it disconnects as for TCP
+static void close_conn(struct udp_conn *conn) {
+    struct udp_conn **current = &conns;
+    while (*current && *current != conn) {
+        current = &(*current)->next;
+    }
+    if (*current) {
+        *current = conn->next;
+    }
+    reactor_del(&conn->handler);
+    close(conn->sock);
+    reactor_defer_free(conn, free_conn);
+}
+
+static struct udp_stream *get_stream(struct udp_conn *conn, int id) {
+    if (!conn->streams[id]) {
+        conn->streams[id] = calloc(1, sizeof(struct udp_stream));
+    }
+    return conn->streams[id];
+}
+
+static void write_header(uint8_t *out, struct udp_conn *conn, uint8_t type, uint32_t pkt) {
+    out[0] = UDP_MAGIC;
+    out[1] = UDP_VERSION;
+    out[2] = type;
+    out[3] = 0;
+    put32(out + 4, conn->id);
+    put32(out + 8, pkt);
+}
+
+// Returns -1 if the socket buffer is full, the datagram is tried again later
+static int send_datagram(struct udp_conn *conn, const uint8_t *data, size_t len) {
+    while (sendto(udp_socket, data, len, MSG_DONTWAIT, (struct sockaddr *)&conn->addr, sizeof(conn->addr)) < 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            return -1;
+        }
+        // Unreachable and the like, recovered from like a loss
+        break;
+    }
+    return 0;
+}
+
+static int send_seg(struct udp_conn *conn, struct udp_seg *seg) {
+    uint8_t dgram[UDP_DATAGRAM_MAX];
+    write_header(dgram, conn, UDP_DATA, conn->next_pkt);
+    put16(dgram + UDP_HDR, seg->stream);
+    put32(dgram + UDP_HDR + 2, (uint32_t)(seg->offset >> 32));
+    put32(dgram + UDP_HDR + 6, (uint32_t)seg->offset);
+    memcpy(dgram + UDP_DATA_HDR, seg->data, seg->len);
+    if (send_datagram(conn, dgram, UDP_DATA_HDR + seg->len) < 0) {
+        return -1;
+    }
+
+    uint64_t now = reactor_now_ms();
+    if (!conn->flight) {
+        // The wait for an answer starts now, not at the last ACK before an idle spell
+        conn->last_ack_ms = now;
+    }
+    seg->pkt = conn->next_pkt++;
+    seg->sent_ms = now;
+    seg->next = NULL;
+    if (conn->flight_tail) {
+        conn->flight_tail->next = seg;
+    } else {
+        conn->flight = seg;
+    }
+    conn->flight_tail = seg;
+    conn->flight_bytes += seg->len;
+    return 0;
+}
+
+static void send_ack(struct udp_conn *conn) {
+    uint8_t dgram[UDP_HDR + 1 + UDP_ACK_RANGES * 8];
+    write_header(dgram, conn, UDP_ACK, 0);
+    dgram[UDP_HDR] = conn->nranges;
+    for (int i = 0; i < conn->nranges; i++) {
+        put32(dgram + UDP_HDR + 1 + i * 8, conn->ranges[i].hi);
+        put32(dgram + UDP_HDR + 5 + i * 8, conn->ranges[i].lo);
+    }
+    send_datagram(conn, dgram, UDP_HDR + 1 + conn->nranges * 8);
+}
+
+static void send_close(struct udp_conn *conn) {
+    uint8_t dgram[UDP_HDR];
+    write_header(dgram, conn, UDP_CLOSE, 0);
+    send_datagram(conn, dgram, sizeof(dgram));
+}
+
+/*
+ * Whether the frame at head is a RES, or -1 until enough of it is
+ * buffered to tell.
+ */
+static int frame_is_res(const uint8_t *head, size_t avail, size_t *size) {
+    uint16_t msg_code;
+    size_t hdr_len;
+    *size = pkt_frame_peek(head, avail, &msg_code, &hdr_len);
+    if (*size == 0) {
+        return -1;
+    }
+    return msg_code == PKT_MSG_RES;
+}
+
+/*
+ * Takes a stream for one RES, the next in turn with no segments still
+ * unacknowledged. With every one busy the next in turn is shared.
+ */
+static int take_stream(struct udp_conn *conn) {
+    for (int i = 0; i < UDP_STREAMS - 1; i++) {
+        int id = 1 + conn->next_stream;
+        conn->next_stream = (conn->next_stream + 1) % (UDP_STREAMS - 1);
+        if (!conn->streams[id] || conn->streams[id]->unacked == 0) {
+            return id;
+        }
+    }
+    int id = 1 + conn->next_stream;
+    conn->next_stream = (conn->next_stream + 1) % (UDP_STREAMS - 1);
+    return id;
+}
+
+/*
+ * Cuts the next segment from the bytes the peer wrote. Consecutive control
+ * messages share a segment, so a burst of them goes out in few datagrams,
+ * a RES never shares one.
+ */
+static struct udp_seg *cut_segment(struct udp_conn *conn) {
+    struct udp_seg *seg = NULL;
+    while (1) {
+        const uint8_t *head = conn->in.data + conn->in.start;
+        size_t avail = buf_len(&conn->in);
+        if (conn->cut_left == 0) {
+            size_t size;
+            int res = frame_is_res(head, avail, &size);
+            if (res < 0 || (seg && (res || seg->stream != 0))) {
+                break;
+            }
+            conn->cut_stream = res ? take_stream(conn) : 0;
+            conn->cut_left = size;
+        }
+        size_t n = avail < conn->cut_left ? avail : conn->cut_left;
+        if (seg && n > (size_t)(UDP_SEG_MAX - seg->len)) {
+            n = UDP_SEG_MAX - seg->len;
+        } else if (!seg && n > UDP_SEG_MAX) {
+            n = UDP_SEG_MAX;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        struct udp_stream *stream = get_stream(conn, conn->cut_stream);
+        if (!seg) {
+            seg = malloc(sizeof(struct udp_seg));
+            if (!seg || !stream) {
+                free(seg);
+                return NULL;
+            }
+            seg->stream = conn->cut_stream;
+            seg->offset = stream->send_offset;
+            seg->len = 0;
+            stream->unacked++;
+        }
+        memcpy(seg->data + seg->len, head, n);
+        seg->len += n;
+        stream->send_offset += n;
+        conn->in.start += n;
+        conn->cut_left -= n;
+    }
+    return seg;
+}
+
+// Hands complete frames to the peer, returns -1 if its end is gone
+static int write_peer(struct udp_conn *conn) {
+    while (buf_len(&conn->out) > 0) {
+        ssize_t n = write(conn->sock, conn->out.data + conn->out.start, buf_len(&conn->out));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        conn->out.start += n;
+    }
+    return 0;
+}
+
+// Takes what the peer wrote, within the read-ahead and the send limit
+static void read_peer(struct udp_conn *conn) {
+    while (!conn->closing && buf_len(&conn->in) < UDP_READ_AHEAD && conn->flight_bytes < UDP_SEND_MAX) {
+        if (buf_reserve(&conn->in, UDP_READ_AHEAD) < 0) {
+            return;
+        }
+        ssize_t n = read(conn->sock, conn->in.data + conn->in.end, conn->in.cap - conn->in.end);
+        if (n > 0) {
+            conn->in.end += n;
+        } else if (n == 0) {
+            conn->closing = 1;
+        } else if (errno != EINTR) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn->closing = 1;
+            }
+            return;
+        }
+    }
+}
+
+// Sends lost segments, then new ones, while the congestion window has room
+static void pump(struct udp_conn *conn) {
+    read_peer(conn);
+    while (conn->flight_bytes < conn->cwnd) {
+        struct udp_seg *seg = conn->retx;
+        if (seg) {
+            conn->retx = seg->next;
+            if (!conn->retx) {
+                conn->retx_tail = NULL;
+            }
+        } else if (!(seg = cut_segment(conn))) {
+            break;
+        }
+        if (send_seg(conn, seg) < 0) {
+            seg->next = conn->retx;
+            conn->retx = seg;
+            if (!conn->retx_tail) {
+                conn->retx_tail = seg;
+            }
+            break;
+        }
+        if (buf_len(&conn->in) < UDP_READ_AHEAD / 2) {
+            read_peer(conn);
+        }
+    }
+}
+
+static void on_conn_event(void *ctx, uint32_t events) {
+    struct udp_conn *conn = ctx;
+    if (write_peer(conn) < 0) {
+        conn->closing = 1;
+    }
+    pump(conn);
+}
+
+static struct udp_conn *find_conn(const struct sockaddr_in *addr, uint32_t id) {
+    struct udp_conn *conn = conns;
+    while (conn && (conn->id != id || conn->addr.sin_addr.s_addr != addr->sin_addr.s_addr ||
+                    conn->addr.sin_port != addr->sin_port)) {
+        conn = conn->next;
+    }
+    return conn;
+}
+
+/*
+ * Creates the connection and the peer that talks through it. A rejected
+ * connection gets no peer, its end of the pair is handed the DSN that
+ * turns away TCP and local connections, which goes out as usual before
+ * the connection closes.
+ */
+static struct udp_conn *open_conn(const struct sockaddr_in *addr, uint32_t id, int reject) {
+    struct udp_conn *conn = calloc(1, sizeof(struct udp_conn));
+    int pair[2];
+    if (!conn || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) < 0) {
+        fprintf(stderr, "Failed to set up UDP connection\n");
+        free(conn);
+        return NULL;
+    }
+    conn->addr = *addr;
+    inet_ntop(AF_INET, &addr->sin_addr, conn->ip, sizeof(conn->ip));
+    conn->port = ntohs(addr->sin_port);
+    conn->id = id;
+    conn->sock = pair[1];
+    conn->next_pkt = 1;
+    conn->cwnd = UDP_INIT_CWND;
+    conn->ssthresh = UDP_SEND_MAX;
+    conn->rto_ms = UDP_RTO_INIT_MS;
+    conn->last_ack_ms = reactor_now_ms();
+    conn->handler.fd = conn->sock;
+    conn->handler.fn = on_conn_event;
+    conn->handler.ctx = conn;
+    if (reactor_add(&conn->handler, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) < 0) {
+        perror("epoll_ctl");
+        close(pair[0]);
+        close(pair[1]);
+        free(conn);
+        return NULL;
+    }
+    conn->next = conns;
+    conns = conn;
+
+    if (reject) {
+        conn->rejected = 1;
+        peer_reject(pair[0]);
+        return conn;
+    }
+    if (!peer_register(pair[0], conn->ip, conn->port)) {
+        close_conn(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+// Adds a packet number to the received ranges, the lowest range goes when they are full
+static void note_received(struct udp_conn *conn, uint32_t pkt) {
+    struct udp_range *ranges = conn->ranges;
+    int i = 0;
+    while (i < conn->nranges && ranges[i].lo > pkt + 1) {
+        i++;
+    }
+    if (i < conn->nranges && ranges[i].hi + 1 >= pkt) {
+        if (pkt > ranges[i].hi) {
+            ranges[i].hi = pkt;
+        }
+        if (pkt < ranges[i].lo) {
+            ranges[i].lo = pkt;
+        }
+        if (i + 1 < conn->nranges && ranges[i + 1].hi + 1 >= ranges[i].lo) {
+            ranges[i].lo = ranges[i + 1].lo;
+            conn->nranges--;
+            memmove(ranges + i + 1, ranges + i + 2, (conn->nranges - i - 1) * sizeof(struct udp_range));
+        }
+        return;
+    }
+    if (conn->nranges == UDP_ACK_RANGES) {
+        if (i == conn->nranges) {
+            return;
+        }
+        conn->nranges--;
+    }
+    memmove(ranges + i + 1, ranges + i, (conn->nranges - i) * sizeof(struct udp_range));
+    ranges[i].hi = ranges[i].lo = pkt;
+    conn->nranges++;
+}
+
+// Moves the bytes now in order to the stream's frame, and the frames now complete to the peer
+static int deliver(struct udp_conn *conn, struct udp_stream *stream) {
+    while (stream->ooo && stream->ooo->offset <= stream->recv_offset) {
+        struct udp_seg *seg = stream->ooo;
+        stream->ooo = seg->next;
+        uint64_t end = seg->offset + seg->len;
+        if (end > stream->recv_offset) {
+            size_t skip = stream->recv_offset - seg->offset;
+            if (buf_append(&stream->frame, seg->data + skip, seg->len - skip) < 0) {
+                free(seg);
+                return -1;
+            }
+            stream->recv_offset = end;
+        }
+        free(seg);
+    }
+
+    while (buf_len(&stream->frame) > 0) {
+        uint16_t msg_code;
+        size_t hdr_len;
+        const uint8_t *head = stream->frame.data + stream->frame.start;
+        size_t size = pkt_frame_peek(head, buf_len(&stream->frame), &msg_code, &hdr_len);
+        if (size > PKT_V1_HDR + PKT_BODY_MAX) {
+            return -1;
+        }
+        if (size == 0 || size > buf_len(&stream->frame)) {
+            break;
+        }
+        if (buf_append(&conn->out, head, size) < 0) {
+            return -1;
+        }
+        stream->frame.start += size;
+    }
+    return 0;
+}
+
+static int on_data(struct udp_conn *conn, uint32_t pkt, const uint8_t *body, size_t len) {
+    if (len < UDP_DATA_HDR - UDP_HDR) {
+        return 0;
+    }
+    uint16_t id = get16(body);
+    uint64_t offset = (uint64_t)get32(body + 2) << 32 | get32(body + 6);
+    const uint8_t *data = body + UDP_DATA_HDR - UDP_HDR;
+    size_t data_len = len - (UDP_DATA_HDR - UDP_HDR);
+    if (id >= UDP_STREAMS || data_len == 0) {
+        return 0;
+    }
+    // Left unacknowledged while the peer is behind, the sender backs off and resends
+    if (buf_len(&conn->out) > UDP_RECV_MAX) {
+        return 0;
+    }
+    struct udp_stream *stream = get_stream(conn, id);
+    if (!stream) {
+        return 0;
+    }
+    if (offset > stream->recv_offset + UDP_RECV_MAX) {
+        return 0;
+    }
+    note_received(conn, pkt);
+    conn->ack_pending = 1;
+    if (offset + data_len <= stream->recv_offset) {
+        return 0;
+    }
+
+    struct udp_seg **slot = &stream->ooo;
+    while (*slot && (*slot)->offset < offset) {
+        slot = &(*slot)->next;
+    }
+    if (*slot && (*slot)->offset == offset && (*slot)->len >= data_len) {
+        return 0;
+    }
+    struct udp_seg *seg = malloc(sizeof(struct udp_seg));
+    if (!seg) {
+        return 0;
+    }
+    seg->stream = id;
+    seg->offset = offset;
+    seg->len = data_len;
+    memcpy(seg->data, data, data_len);
+    seg->next = *slot;
+    *slot = seg;
+    return deliver(conn, stream);
+}
+
+static void on_ack(struct udp_conn *conn, const uint8_t *body, size_t len) {
+    int nranges = len > 0 ? body[0] : 0;
+    if (nranges == 0 || nranges > UDP_ACK_RANGES || len < 1 + (size_t)nranges * 8) {
+        return;
+    }
+    struct udp_range ranges[UDP_ACK_RANGES];
+    for (int i = 0; i < nranges; i++) {
+        ranges[i].hi = get32(body + 1 + i * 8);
+        ranges[i].lo = get32(body + 5 + i * 8);
+    }
+    uint32_t largest = ranges[0].hi;
+    uint32_t lowest = ranges[nranges - 1].lo;
+    uint64_t now = reactor_now_ms();
+    if (!conn->established) {
+        conn->established = 1;
+        printf("Connection established with peer\n");
+    }
+
+    size_t acked = 0;
+    int congested = 0;
+    struct udp_seg **slot = &conn->flight;
+    struct udp_seg *prev = NULL;
+    while (*slot) {
+        struct udp_seg *seg = *slot;
+        int hit = 0;
+        for (int i = 0; i < nranges && !hit; i++) {
+            hit = seg->pkt >= ranges[i].lo && seg->pkt <= ranges[i].hi;
+        }
+        int overdue = now - seg->sent_ms > conn->srtt * 9 / 8 + UDP_TICK_MS;
+        int lost = seg->pkt < largest && (overdue || (seg->pkt >= lowest && seg->pkt + UDP_REORDER <= largest));
+        if (!hit && !lost) {
+            prev = seg;
+            slot = &seg->next;
+            continue;
+        }
+
+        *slot = seg->next;
+        conn->flight_bytes -= seg->len;
+        if (hit) {
+            if (seg->pkt == largest) {
+                double sample = now - seg->sent_ms;
+                if (conn->srtt == 0) {
+                    conn->srtt = sample;
+                    conn->rttvar = sample / 2;
+                } else {
+                    conn->rttvar = 0.75 * conn->rttvar + 0.25 * (conn->srtt > sample ? conn->srtt - sample : sample - conn->srtt);
+                    conn->srtt = 0.875 * conn->srtt + 0.125 * sample;
+                }
+            }
+            acked += seg->len;
+            conn->streams[seg->stream]->unacked--;
+            free(seg);
+        } else {
+            congested |= seg->pkt > conn->recovery_pkt;
+            seg->next = NULL;
+            if (conn->retx_tail) {
+                conn->retx_tail->next = seg;
+            } else {
+                conn->retx = seg;
+            }
+            conn->retx_tail = seg;
+        }
+    }
+    conn->flight_tail = prev;
+
+    if (acked > 0) {
+        conn->last_ack_ms = now;
+        uint64_t rto = conn->srtt + 4 * conn->rttvar + UDP_TICK_MS;
+        conn->rto_ms = rto < UDP_RTO_MIN_MS ? UDP_RTO_MIN_MS : rto > UDP_RTO_MAX_MS ? UDP_RTO_MAX_MS : rto;
+        if (conn->cwnd < conn->ssthresh) {
+            conn->cwnd += acked;
+        } else {
+            conn->cwnd += (double)UDP_SEG_MAX * acked / conn->cwnd;
+        }
+        if (conn->cwnd > UDP_SEND_MAX) {
+            conn->cwnd = UDP_SEND_MAX;
+        }
+    }
+    if (congested) {
+        conn->ssthresh = conn->cwnd / 2 > UDP_MIN_CWND ? conn->cwnd / 2 : UDP_MIN_CWND;
+        conn->cwnd = conn->ssthresh;
+        conn->recovery_pkt = conn->next_pkt - 1;
+    }
+    pump(conn);
+}
+
+// Receives every waiting datagram, then acknowledges each connection that got data
+static void on_udp_event(void *ctx, uint32_t events) {
+    uint8_t dgram[UDP_DATAGRAM_MAX];
+    while (1) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(udp_socket, dgram, sizeof(dgram), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (n < UDP_HDR || dgram[0] != UDP_MAGIC || dgram[1] != UDP_VERSION) {
+            continue;
+        }
+        if (config.udp_loss_percent > 0 && rand() % 100 < config.udp_loss_percent) {
+            continue;
+        }
+
+        uint8_t type = dgram[2];
+        uint32_t id = get32(dgram + 4);
+        uint32_t pkt = get32(dgram + 8);
+        struct udp_conn *conn = find_conn(&from, id);
+        if (!conn) {
+            // Only the first bytes of stream 0, the HEL, open a connection
+            if (type != UDP_DATA || n < UDP_DATA_HDR || get16(dgram + UDP_HDR) != 0 ||
+                get32(dgram + UDP_HDR + 2) != 0 || get32(dgram + UDP_HDR + 6) != 0) {
+                continue;
+            }
+            int full = peer_count() >= config.max_peers;
+            conn = open_conn(&from, id, full);
+            if (!conn) {
+                continue;
+            }
+            conn->established = 1;
+            if (full) {
+                printf("Peer limit of %d reached.\n", config.max_peers);
+            } else {
+                printf("Accepted connection from peer.\n");
+            }
+        }
+
+        if (type == UDP_DATA && conn->rejected) {
+            continue;
+        } else if (type == UDP_DATA) {
+            if (on_data(conn, pkt, dgram + UDP_HDR, n - UDP_HDR) < 0 || write_peer(conn) < 0) {
+                fprintf(stderr, "Malformed data from %s:%d\n", conn->ip, conn->port);
+                close_conn(conn);
+            }
+        } else if (type == UDP_ACK) {
+            on_ack(conn, dgram + UDP_HDR, n - UDP_HDR);
+        } else if (type == UDP_CLOSE) {
+            close_conn(conn);
+        }
+    }
+
+    for (struct udp_conn *conn = conns; conn; conn = conn->next) {
+        if (conn->ack_pending) {
+            conn->ack_pending = 0;
+            send_ack(conn);
+        }
+    }
+}
+
+/*
+ * Resends on timeout, gives up on connections that stopped answering and
+ * closes those the peer is done with once everything is acknowledged.
+ */
+static void on_udp_tick(void *ctx, uint32_t events) {
+    uint64_t now = reactor_now_ms();
+    struct udp_conn *conn = conns;
+    while (conn) {
+        struct udp_conn *next = conn->next;
+        if (conn->flight && now - conn->last_ack_ms > UDP_DEAD_MS) {
+            if (conn->established) {
+                printf("Peer %s:%d stopped answering.\n", conn->ip, conn->port);
+            } else {
+                printf("Connection to %s:%d failed: no answer\n", conn->ip, conn->port);
+            }
+            close_conn(conn);
+            conn = next;
+            continue;
+        }
+
+        if (conn->flight && now - conn->flight->sent_ms >= conn->rto_ms) {
+            // Everything in flight is presumed lost and resent ahead of older losses
+            conn->flight_tail->next = conn->retx;
+            if (!conn->retx) {
+                conn->retx_tail = conn->flight_tail;
+            }
+            conn->retx = conn->flight;
+            conn->flight = conn->flight_tail = NULL;
+            conn->flight_bytes = 0;
+            conn->ssthresh = conn->cwnd / 2 > UDP_MIN_CWND ? conn->cwnd / 2 : UDP_MIN_CWND;
+            conn->cwnd = UDP_MIN_CWND;
+            conn->recovery_pkt = conn->next_pkt - 1;
+            conn->rto_ms = conn->rto_ms * 2 < UDP_RTO_MAX_MS ? conn->rto_ms * 2 : UDP_RTO_MAX_MS;
+        }
+        pump(conn);
+
+        if (conn->closing && !conn->flight && !conn->retx && buf_len(&conn->in) == 0) {
+            send_close(conn);
+            close_conn(conn);
+        }
+        conn = next;
+    }
+}
+
+// Takes datagrams on port, every connection shares the one socket
+int udp_listen(uint16_t port) {
+    udp_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (udp_socket < 0) {
+        perror("UDP socket");
+        return -1;
+    }
+    int size = UDP_SOCKET_BUF;
+    setsockopt(udp_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(udp_socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(udp_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("UDP bind failed");
+        close(udp_socket);
+        udp_socket = -1;
+        return -1;
+    }
+
+    udp_handler.fd = udp_socket;
+    udp_handler.fn = on_udp_event;
+    timer_handler.fn = on_udp_tick;
+    if (reactor_add(&udp_handler, EPOLLIN | EPOLLET) < 0 || reactor_add_timer(&timer_handler, UDP_TICK_MS) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+// Opens a connection to ip:port, it is established once the other side answers the HEL
+int udp_connect(const char *ip, int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0 || port <= 0 || port > 65535) {
+        printf("Invalid address/Address not supported: %s:%d\n", ip, port);
+        return -1;
+    }
+    if (udp_socket < 0) {
+        printf("UDP transport is not enabled.\n");
+        return -1;
+    }
+    if (peer_count() + dial_pending() >= config.max_peers) {
+        printf("Peer limit of %d reached.\n", config.max_peers);
+        return -1;
+    }
+    uint32_t id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+        id = rand();
+    }
+    return open_conn(&addr, id, 0) ? 0 : -1;
+}
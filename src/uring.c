@@ -0,0 +1,243 @@
+#define _GNU_SOURCE
+#include "../include/net/uring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring driven through the raw syscalls. Operations are
+ * queued, then submitted together and waited for with one io_uring_enter,
+ * so a batch of N reads or sends costs one syscall instead of N.
+ * Everything runs on the reactor thread, and completion callbacks must not
+ * queue more operations.
+ *
+ * This only batches syscalls. uring_submit_wait blocks the reactor until
+ * the whole batch completes, as the preads and sends it replaces would,
+ * and nothing stays in the ring between loop iterations. A slow disk
+ * still stalls every peer for as long as the read takes.
+ */
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned entries;
+    unsigned queued;        // SQEs filled since the last submit
+    uint8_t *bufs;          // URING_NBUFS registered buffers, back to back
+};
+
+static struct uring ring = { .fd = -1 };
+
+static int setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int register_buffers(struct iovec *iov, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, count);
+}
+
+// Maps the rings and registers the packet buffers, returns -1 if io_uring cannot be used
+int uring_init(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = setup(entries, &params);
+    if (ring.fd < 0) {
+        return -1;
+    }
+
+    ring.sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single) {
+        ring.sq_len = ring.cq_len = ring.sq_len > ring.cq_len ? ring.sq_len : ring.cq_len;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                       IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        ring.sq_ptr = NULL;
+        uring_shutdown();
+        return -1;
+    }
+    ring.cq_ptr = single ? ring.sq_ptr
+                         : mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                                IORING_OFF_CQ_RING);
+    if (ring.cq_ptr == MAP_FAILED) {
+        ring.cq_ptr = NULL;
+        uring_shutdown();
+        return -1;
+    }
+    ring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                     IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        uring_shutdown();
+        return -1;
+    }
+
+    uint8_t *sq = ring.sq_ptr;
+    uint8_t *cq = ring.cq_ptr;
+    ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring.entries = params.sq_entries;
+    ring.queued = 0;
+
+    // The kernel pins these pages once instead of mapping them for every read
+    ring.bufs = aligned_alloc(4096, URING_NBUFS * URING_BUF_SIZE);
+    if (!ring.bufs) {
+        uring_shutdown();
+        return -1;
+    }
+    struct iovec iov[URING_NBUFS];
+    for (int i = 0; i < URING_NBUFS; i++) {
+        iov[i].iov_base = ring.bufs + i * URING_BUF_SIZE;
+        iov[i].iov_len = URING_BUF_SIZE;
+    }
+    if (register_buffers(iov, URING_NBUFS) < 0) {
+        uring_shutdown();
+        return -1;
+    }
+    return 0;
+}
+
+int uring_enabled() {
+    return ring.fd >= 0;
+}
+
+void uring_shutdown() {
+    if (ring.sqes) {
+        munmap(ring.sqes, ring.sqes_len);
+    }
+    if (ring.cq_ptr && ring.cq_ptr != ring.sq_ptr) {
+        munmap(ring.cq_ptr, ring.cq_len);
+    }
+    if (ring.sq_ptr) {
+        munmap(ring.sq_ptr, ring.sq_len);
+    }
+    if (ring.fd >= 0) {
+        close(ring.fd);
+    }
+    free(ring.bufs);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+uint8_t *uring_buffer(int index) {
+    return ring.bufs + index * URING_BUF_SIZE;
+}
+
+// Returns a cleared SQE, or NULL once the ring holds a full batch
+static struct io_uring_sqe *next_sqe(uint64_t tag) {
+    if (ring.fd < 0 || ring.queued >= ring.entries) {
+        return NULL;
+    }
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = tag;
+    ring.sq_array[index] = index;
+    return sqe;
+}
+
+// Publishes the SQE filled by next_sqe to the kernel
+static void commit_sqe() {
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+}
+
+int uring_queue_read_fixed(int fd, int buf_index, size_t buf_offset, size_t len, off_t offset, uint64_t tag) {
+    struct io_uring_sqe *sqe = next_sqe(tag);
+    if (!sqe || buf_index < 0 || buf_index >= URING_NBUFS || buf_offset + len > URING_BUF_SIZE) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(uring_buffer(buf_index) + buf_offset);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = buf_index;
+    commit_sqe();
+    return 0;
+}
+
+int uring_queue_send(int socket, const void *buf, size_t len, int flags, uint64_t tag) {
+    struct io_uring_sqe *sqe = next_sqe(tag);
+    if (!sqe) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = socket;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+    commit_sqe();
+    return 0;
+}
+
+int uring_queued() {
+    return ring.queued;
+}
+
+/*
+ * Submits every queued operation and waits for all of them, handing each
+ * result to fn as it is reaped. res is what the syscall would have
+ * returned, or -errno. Returns -1 if the batch could not be submitted.
+ */
+int uring_submit_wait(uring_complete_fn fn, void *ctx) {
+    unsigned submit = ring.queued;
+    unsigned pending = ring.queued;
+    while (pending > 0) {
+        int rc = enter(submit, 1, IORING_ENTER_GETEVENTS);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_uring_enter");
+            return -1;
+        }
+        submit -= (unsigned)rc < submit ? (unsigned)rc : submit;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            if (fn) {
+                fn(ctx, cqe->user_data, cqe->res);
+            }
+            head++;
+            pending--;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    ring.queued = 0;
+    return 0;
+}
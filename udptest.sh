@@ -0,0 +1,101 @@
+#!/bin/bash
+# Downloads a package between two btide instances over loopback UDP while
+# each drops a share of arriving datagrams, then checks the copy is whole.
+# Usage: bash udptest.sh [loss percent...]
+
+BTIDE=./btide
+NCHUNKS=16
+CHUNK=65536
+PORT=9310
+TIMEOUT=${TIMEOUT:-60}
+LOSSES=${@:-0 5 15}
+
+WORK=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; rm -rf "$WORK"' EXIT
+
+hex_sha() {
+    sha256sum | cut -d' ' -f1
+}
+
+# Writes a .bpkg for data.bin in $1, chunk hashes are the Merkle leaves
+make_package() {
+    local dir=$1
+    local leaves=()
+    for ((i = 0; i < NCHUNKS; i++)); do
+        leaves+=("$(dd if="$dir/data.bin" bs=$CHUNK skip=$i count=1 2>/dev/null | hex_sha)")
+    done
+    local tree=("${leaves[@]}")
+    local level=("${leaves[@]}")
+    while ((${#level[@]} > 1)); do
+        local up=()
+        for ((i = 0; i < ${#level[@]}; i += 2)); do
+            up+=("$(printf '%s%s' "${level[i]}" "${level[i + 1]}" | hex_sha)")
+        done
+        tree=("${up[@]}" "${tree[@]}")
+        level=("${up[@]}")
+    done
+
+    {
+        echo "ident: $(head -c 32 /dev/urandom | od -An -tx1 | tr -d ' \n')"
+        echo "filename: data.bin"
+        echo "size: $((NCHUNKS * CHUNK))"
+        echo "nhashes: $((NCHUNKS - 1))"
+        echo "hashes:"
+        for ((i = 0; i < NCHUNKS - 1; i++)); do
+            printf '\t%s\n' "${tree[i]}"
+        done
+        echo "nchunks: $NCHUNKS"
+        echo "chunks:"
+        for ((i = 0; i < NCHUNKS; i++)); do
+            printf '\t%s,%d,%d\n' "${leaves[i]}" $((i * CHUNK)) $CHUNK
+        done
+    } > "$dir/data.bpkg"
+}
+
+write_config() {
+    printf 'directory:%s\nmax_peers:8\nport:%d\nudp_transport:1\nudp_loss_percent:%d\n' "$1" "$2" "$3" > "$4"
+}
+
+mkdir -p "$WORK/seed"
+head -c $((NCHUNKS * CHUNK)) /dev/urandom > "$WORK/seed/data.bin"
+make_package "$WORK/seed"
+ident=$(grep '^ident:' "$WORK/seed/data.bpkg" | cut -d' ' -f2)
+
+failed=0
+for loss in $LOSSES; do
+    rm -rf "$WORK/get" "$WORK"/*.in
+    mkdir -p "$WORK/get"
+    cp "$WORK/seed/data.bpkg" "$WORK/get/"
+    write_config "$WORK/seed" $PORT "$loss" "$WORK/seed.cfg"
+    write_config "$WORK/get" $((PORT + 1)) "$loss" "$WORK/get.cfg"
+    mkfifo "$WORK/seed.in" "$WORK/get.in"
+
+    $BTIDE "$WORK/seed.cfg" < "$WORK/seed.in" > "$WORK/seed.out" 2>&1 &
+    exec 3> "$WORK/seed.in"
+    echo "ADDPACKAGE data.bpkg" >&3
+    sleep 0.5
+    $BTIDE "$WORK/get.cfg" < "$WORK/get.in" > "$WORK/get.out" 2>&1 &
+    exec 4> "$WORK/get.in"
+    printf 'ADDPACKAGE data.bpkg\nCONNECT udp:127.0.0.1:%d\n' $PORT >&4
+    sleep 1
+    echo "DOWNLOAD $ident" >&4
+
+    for ((t = 0; t < TIMEOUT * 10; t++)); do
+        grep -q "Download of .* complete" "$WORK/get.out" && break
+        sleep 0.1
+    done
+    echo QUIT >&4
+    echo QUIT >&3
+    exec 3>&- 4>&-
+    wait
+
+    if cmp -s "$WORK/seed/data.bin" "$WORK/get/data.bin"; then
+        echo "udp loss $loss%: PASS in $((t / 10))s"
+    else
+        echo "udp loss $loss%: FAIL"
+        cat "$WORK/get.out"
+        failed=1
+    fi
+    PORT=$((PORT + 2))
+done
+exit $failed